@@ -0,0 +1,146 @@
+/**
+ * File: benchmark_transform.cpp
+ * Description: measures the time and the heap allocations of converting
+ *   ORB features into words with TemplatedVocabulary::transform
+ * License: see the LICENSE.txt file
+ */
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <new>
+#include <chrono>
+#include <random>
+
+// DBoW2
+#include "DBoW2.h" // defines OrbVocabulary
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+using namespace DBoW2;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//ds number of heap allocations done by the process so far
+static size_t number_of_allocations = 0;
+
+void* operator new(size_t size) {
+  ++number_of_allocations;
+  void* p = std::malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](size_t size) {
+  ++number_of_allocations;
+  void* p = std::malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  std::free(p);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//ds training set and frame sizes
+const int NUMBER_OF_TRAINING_IMAGES = 50;
+const int FEATURES_PER_IMAGE        = 1000;
+const int NUMBER_OF_FRAMES          = 20;
+
+void createRandomFeatures(std::vector<std::vector<FORB::TDescriptor> >& features_,
+                          const int number_of_images_,
+                          std::mt19937& generator_);
+
+int32_t main() {
+  std::mt19937 generator(0);
+
+  // branching factor and depth levels
+  const int k = 10;
+  const int L = 4;
+
+  std::vector<std::vector<FORB::TDescriptor> > training_features;
+  createRandomFeatures(training_features, NUMBER_OF_TRAINING_IMAGES, generator);
+
+  std::cout << "Creating a " << k << "^" << L << " vocabulary..." << std::endl;
+  OrbVocabulary voc(k, L, TF_IDF, L1_NORM);
+  voc.create(training_features);
+  std::cout << voc << std::endl;
+  std::cout << "Hamming distance implementation: " << Hamming::implementation() << std::endl;
+
+  std::vector<std::vector<FORB::TDescriptor> > frames;
+  createRandomFeatures(frames, NUMBER_OF_FRAMES, generator);
+
+  //ds single feature transforms: must not touch the heap. A first call
+  //ds sets up what the library keeps for the whole process
+  WordId checksum = voc.transform(frames[0][0]);
+  const size_t allocations_before = number_of_allocations;
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < frames.size(); ++i) {
+    for (size_t j = 0; j < frames[i].size(); ++j) {
+      checksum += voc.transform(frames[i][j]);
+    }
+  }
+  const double duration_seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  const size_t allocations = number_of_allocations - allocations_before;
+  const size_t number_of_calls = frames.size() * FEATURES_PER_IMAGE;
+
+  std::cout << "transform(feature): " << number_of_calls << " calls, "
+            << duration_seconds * 1000.0 / frames.size() << " ms per frame of "
+            << FEATURES_PER_IMAGE << " features, "
+            << static_cast<double>(allocations) / number_of_calls
+            << " heap allocations per call (checksum: " << checksum << ")" << std::endl;
+
+  //ds complete frame transforms, for reference
+  BowVector bow_vector;
+  FeatureVector feature_vector;
+  const size_t allocations_before_frames = number_of_allocations;
+  const std::chrono::steady_clock::time_point start_frames = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < frames.size(); ++i) {
+    voc.transform(frames[i], bow_vector, feature_vector, 2);
+  }
+  const double duration_seconds_frames = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start_frames).count();
+
+  std::cout << "transform(features, BowVector, FeatureVector): "
+            << duration_seconds_frames * 1000.0 / frames.size() << " ms per frame, "
+            << static_cast<double>(number_of_allocations - allocations_before_frames) / frames.size()
+            << " heap allocations per frame" << std::endl;
+
+  //ds fail if the single feature descent allocates
+  return (allocations == 0 ? 0 : 1);
+}
+
+void createRandomFeatures(std::vector<std::vector<FORB::TDescriptor> >& features_,
+                          const int number_of_images_,
+                          std::mt19937& generator_) {
+  features_.resize(number_of_images_);
+  for (int i = 0; i < number_of_images_; ++i) {
+    features_[i].resize(FEATURES_PER_IMAGE);
+    for (int j = 0; j < FEATURES_PER_IMAGE; ++j) {
+      features_[i][j].create(1, FORB::L, CV_8U);
+      unsigned char* p = features_[i][j].ptr<unsigned char>();
+      for (int b = 0; b < FORB::L; ++b) {
+        p[b] = static_cast<unsigned char>(generator_());
+      }
+    }
+  }
+}
@@ -0,0 +1,185 @@
+/**
+ * File: test_batch_query.cpp
+ * Description: checks that queryBatch and the queries of the sharded
+ *   databases return the same results as the plain queries, for every
+ *   scoring type, with erased entries and compressed inverted files
+ * License: see the LICENSE.txt file
+ */
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+// DBoW2
+#include "DBoW2.h" // defines OrbVocabulary, OrbDatabase and OrbShardedDatabase
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+#include "test_utils.h"
+
+using namespace DBoW2;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void createVectors(std::mt19937& generator_,
+                   const unsigned int number_of_words_,
+                   const ScoringType scoring_,
+                   const size_t number_of_vectors_,
+                   std::vector<BowVector>& vectors_);
+void testScoring(std::mt19937& generator_, OrbVocabulary& vocabulary_, const ScoringType scoring_);
+
+int32_t main() {
+  std::mt19937 generator(0);
+
+  OrbVocabulary vocabulary(4, 2, TF_IDF, L1_NORM);
+  createVocabulary(generator, vocabulary);
+  if (vocabulary.size() < 8) {
+    check(false, "vocabulary created");
+  } else {
+    for (const ScoringType scoring: {L1_NORM, L2_NORM, CHI_SQUARE, KL, BHATTACHARYYA, DOT_PRODUCT}) {
+      testScoring(generator, vocabulary, scoring);
+    }
+  }
+
+  return reportChecks();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//ds random bow vectors with a few words each, normalized as the scoring requires
+void createVectors(std::mt19937& generator_,
+                   const unsigned int number_of_words_,
+                   const ScoringType scoring_,
+                   const size_t number_of_vectors_,
+                   std::vector<BowVector>& vectors_) {
+  std::uniform_int_distribution<unsigned int> word(0, number_of_words_ - 1);
+  std::uniform_real_distribution<double> weight(0.01, 1);
+
+  vectors_.resize(number_of_vectors_);
+  for (size_t i = 0; i < number_of_vectors_; ++i) {
+    vectors_[i].clear();
+    for (int j = 0; j < 6; ++j) {
+      vectors_[i].addIfNotExist(word(generator_), static_cast<WordValue>(weight(generator_)));
+    }
+    if (scoring_ == L2_NORM) {
+      vectors_[i].normalize(L2);
+    } else if (scoring_ != DOT_PRODUCT) {
+      vectors_[i].normalize(L1);
+    }
+  }
+}
+
+//ds checks that two lists of results have the same entries in the same order and the same scores
+bool sameResults(const QueryResults& expected_, const QueryResults& results_, const double tolerance_) {
+  if (results_.size() != expected_.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < results_.size(); ++i) {
+    if (results_[i].Id != expected_[i].Id ||
+        std::fabs(results_[i].Score - expected_[i].Score) > tolerance_) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//ds checks that two lists of results have the same entries, in any order
+bool sameEntries(const QueryResults& expected_, const QueryResults& results_) {
+  if (results_.size() != expected_.size()) {
+    return false;
+  }
+  QueryResults a(expected_), b(results_);
+  std::sort(a.begin(), a.end(), Result::ltId);
+  std::sort(b.begin(), b.end(), Result::ltId);
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].Id != b[i].Id) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void testScoring(std::mt19937& generator_, OrbVocabulary& vocabulary_, const ScoringType scoring_) {
+  vocabulary_.setScoringType(scoring_);
+
+  //ds enough entries so that the rows of every shard fill several compressed blocks
+  const size_t number_of_entries = 800;
+  std::vector<BowVector> entries, queries;
+  createVectors(generator_, vocabulary_.size(), scoring_, number_of_entries, entries);
+  createVectors(generator_, vocabulary_.size(), scoring_, 20, queries);
+
+  OrbDatabase database(vocabulary_, false);
+  OrbShardedDatabase sharded(vocabulary_, 3, false);
+  database.setThreads(4);
+  sharded.setThreads(3);
+  for (size_t i = 0; i < number_of_entries; ++i) {
+    database.add(entries[i]);
+    sharded.add(entries[i], FeatureVector(), static_cast<int>(i % 3));
+  }
+
+  //ds the results are compared before and after erasing some entries, and
+  //ds then with the compressed inverted files
+  for (int stage = 0; stage < 4; ++stage) {
+    if (stage == 1) {
+      for (EntryId id = 0; id < number_of_entries; id += 7) {
+        database.erase(id);
+        sharded.erase(id);
+      }
+    } else if (stage == 2) {
+      database.setCompression(COMPRESSED_16);
+      sharded.setCompression(COMPRESSED_16);
+    } else if (stage == 3) {
+      database.setCompression(COMPRESSED_8);
+      sharded.setCompression(COMPRESSED_8);
+    }
+
+    //ds the shards quantize their own blocks, so their results are compared
+    //ds with the entries found by an uncompressed database
+    OrbDatabase uncompressed(vocabulary_, false);
+    if (stage >= 2) {
+      for (size_t i = 0; i < number_of_entries; ++i) {
+        uncompressed.add(entries[i]);
+        if (i % 7 == 0) {
+          uncompressed.erase(static_cast<EntryId>(i));
+        }
+      }
+    }
+
+    for (const int max_results: {0, 1, 5}) {
+      for (const int max_id: {-1, 1, 333, static_cast<int>(number_of_entries) + 10}) {
+        std::vector<QueryResults> batch_results;
+        database.queryBatch(queries, batch_results, max_results, max_id);
+        check(batch_results.size() == queries.size(), "queryBatch returns the results of every query");
+        if (batch_results.size() != queries.size()) {
+          return;
+        }
+
+        for (size_t q = 0; q < queries.size(); ++q) {
+          QueryResults expected;
+          database.query(queries[q], expected, max_results, max_id);
+          check(sameResults(expected, batch_results[q], 1e-9), "queryBatch returns the same results as query");
+
+          bool erased_found = false;
+          for (size_t i = 0; i < batch_results[q].size(); ++i) {
+            erased_found = erased_found || database.isErased(batch_results[q][i].Id);
+          }
+          check(!erased_found, "queryBatch does not return erased entries");
+
+          QueryResults sharded_results;
+          sharded.query(queries[q], sharded_results, max_results, max_id);
+          if (stage < 2) {
+            check(sameResults(expected, sharded_results, 1e-9),
+                  "the sharded query returns the same results as query");
+          } else if (max_results == 0) {
+            //ds with all the results, the entries do not depend on the rounding of the scores
+            uncompressed.query(queries[q], expected, max_results, max_id);
+            check(sameEntries(expected, sharded_results),
+                  "the compressed sharded query finds the same entries as query");
+          }
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,345 @@
+/**
+ * File: test_journal.cpp
+ * Description: checks the recovery of the databases from a binary
+ *   snapshot and a journal: replay of added and erased entries, entries
+ *   already in the snapshot, truncated or corrupt trailing records and
+ *   journals of version 1
+ * License: see the LICENSE.txt file
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+// DBoW2
+#include "DBoW2.h" // defines OrbVocabulary and OrbDatabase
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+#include "test_utils.h"
+
+using namespace DBoW2;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//ds gives access to the layout of the journal files
+class JournalDatabase: public OrbDatabase {
+public:
+  typedef OrbDatabase::JournalHeader Header;
+};
+
+//ds files written by the tests
+static const std::string journal_file = "test_journal.jnl";
+static const std::string snapshot_file = "test_journal.db";
+
+void createEntries(std::mt19937& generator_,
+                   const OrbVocabulary& vocabulary_,
+                   const size_t number_of_entries_,
+                   std::vector<BowVector>& vectors_,
+                   std::vector<FeatureVector>& features_);
+void testReplay(const OrbVocabulary& vocabulary_,
+                const std::vector<BowVector>& vectors_,
+                const std::vector<FeatureVector>& features_);
+void testSnapshot(const OrbVocabulary& vocabulary_,
+                  const std::vector<BowVector>& vectors_,
+                  const std::vector<FeatureVector>& features_);
+void testTrailingRecords(const OrbVocabulary& vocabulary_,
+                         const std::vector<BowVector>& vectors_,
+                         const std::vector<FeatureVector>& features_);
+void testVersion1(const OrbVocabulary& vocabulary_,
+                  const std::vector<BowVector>& vectors_,
+                  const std::vector<FeatureVector>& features_);
+
+int32_t main() {
+  std::mt19937 generator(0);
+
+  OrbVocabulary vocabulary(4, 2, TF_IDF, L1_NORM);
+  createVocabulary(generator, vocabulary);
+  if (vocabulary.size() < 8) {
+    check(false, "vocabulary created");
+  } else {
+    std::vector<BowVector> vectors;
+    std::vector<FeatureVector> features;
+    createEntries(generator, vocabulary, 60, vectors, features);
+
+    try {
+      testReplay(vocabulary, vectors, features);
+      testSnapshot(vocabulary, vectors, features);
+      testTrailingRecords(vocabulary, vectors, features);
+      testVersion1(vocabulary, vectors, features);
+    } catch (const std::string& error) {
+      check(false, error.c_str());
+    }
+  }
+
+  std::remove(journal_file.c_str());
+  std::remove(snapshot_file.c_str());
+
+  return reportChecks();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//ds random entries with a few words and the features of each word
+void createEntries(std::mt19937& generator_,
+                   const OrbVocabulary& vocabulary_,
+                   const size_t number_of_entries_,
+                   std::vector<BowVector>& vectors_,
+                   std::vector<FeatureVector>& features_) {
+  std::uniform_int_distribution<unsigned int> word(0, vocabulary_.size() - 1);
+  std::uniform_real_distribution<double> weight(0.01, 1);
+
+  vectors_.resize(number_of_entries_);
+  features_.resize(number_of_entries_);
+  for (size_t i = 0; i < number_of_entries_; ++i) {
+    for (unsigned int j = 0; j < 6; ++j) {
+      const WordId word_id = word(generator_);
+      vectors_[i].addIfNotExist(word_id, static_cast<WordValue>(weight(generator_)));
+      features_[i].addFeature(vocabulary_.getParentNode(word_id, 0), j);
+    }
+    vectors_[i].normalize(L1);
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+std::string readFile(const std::string& filename_) {
+  std::ifstream file(filename_.c_str(), std::ios::in | std::ios::binary);
+  std::stringstream content;
+  content << file.rdbuf();
+  return content.str();
+}
+
+void writeFile(const std::string& filename_, const std::string& content_) {
+  std::ofstream file(filename_.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  file.write(content_.data(), content_.size());
+}
+
+bool fileExists(const std::string& filename_) {
+  std::ifstream file(filename_.c_str());
+  return file.is_open();
+}
+
+//ds checks that a database has the first entries of a list and the expected erased ones
+bool sameEntries(const OrbDatabase& database_,
+                 const std::vector<BowVector>& vectors_,
+                 const std::vector<FeatureVector>& features_,
+                 const size_t number_of_entries_,
+                 const std::vector<EntryId>& erased_) {
+  if (database_.size() != number_of_entries_ || database_.getErasedEntries() != erased_.size()) {
+    return false;
+  }
+  for (EntryId id = 0; id < number_of_entries_; ++id) {
+    const bool erased = (std::find(erased_.begin(), erased_.end(), id) != erased_.end());
+    if (database_.isErased(id) != erased) {
+      return false;
+    }
+    if (!erased && database_.retrieveFeatures(id) != features_[id]) {
+      return false;
+    }
+
+    //ds every entry that is not erased is the best match of its own vector
+    QueryResults results;
+    database_.query(vectors_[id], results, 1);
+    if (!erased && (results.empty() || results[0].Id != id)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void testReplay(const OrbVocabulary& vocabulary_,
+                const std::vector<BowVector>& vectors_,
+                const std::vector<FeatureVector>& features_) {
+  std::remove(journal_file.c_str());
+  const std::vector<EntryId> erased = {3, 10, 11};
+  {
+    OrbDatabase database(vocabulary_);
+    database.openJournal(journal_file);
+    for (size_t i = 0; i < 20; ++i) {
+      database.add(vectors_[i], features_[i]);
+    }
+    for (const EntryId id: erased) {
+      database.erase(id);
+    }
+  }
+
+  //ds a new database recovers the entries and the erased ones from the journal
+  OrbDatabase recovered(vocabulary_);
+  recovered.openJournal(journal_file);
+  check(sameEntries(recovered, vectors_, features_, 20, erased), "the journal is replayed");
+
+  //ds opening the journal again adds nothing
+  recovered.openJournal(journal_file);
+  check(sameEntries(recovered, vectors_, features_, 20, erased), "replayed entries are not added twice");
+
+  //ds a database with other settings does not accept the journal
+  OrbDatabase other(vocabulary_, false);
+  bool rejected = false;
+  try {
+    other.openJournal(journal_file);
+  } catch (const std::string&) {
+    rejected = true;
+  }
+  check(rejected && other.size() == 0, "a journal with other settings is rejected");
+}
+
+void testSnapshot(const OrbVocabulary& vocabulary_,
+                  const std::vector<BowVector>& vectors_,
+                  const std::vector<FeatureVector>& features_) {
+  std::remove(journal_file.c_str());
+  std::remove(snapshot_file.c_str());
+  const std::vector<EntryId> erased = {5, 25, 32};
+  {
+    OrbDatabase database(vocabulary_);
+    database.openJournal(journal_file);
+    for (size_t i = 0; i < 30; ++i) {
+      database.add(vectors_[i], features_[i]);
+    }
+    database.erase(5);
+
+    //ds the snapshot has the first entries, and the new journal the rest
+    database.checkpoint(snapshot_file);
+    check(!fileExists(snapshot_file + ".tmp"), "the snapshot replaces its temporary file");
+    for (size_t i = 30; i < 40; ++i) {
+      database.add(vectors_[i], features_[i]);
+    }
+    database.erase(25);
+    database.erase(32);
+  }
+
+  OrbDatabase recovered;
+  recovered.loadBinary(snapshot_file);
+  check(sameEntries(recovered, vectors_, features_, 30, {5}), "the snapshot is loaded");
+  recovered.openJournal(journal_file);
+  check(sameEntries(recovered, vectors_, features_, 40, erased), "the snapshot and the journal are recovered");
+
+  //ds a snapshot saved without checkpoint has entries that are in the journal too
+  for (size_t i = 40; i < 50; ++i) {
+    recovered.add(vectors_[i], features_[i]);
+  }
+  recovered.saveBinary(snapshot_file);
+  recovered.add(vectors_[50], features_[50]);
+  recovered.closeJournal();
+
+  OrbDatabase skipped;
+  skipped.loadBinary(snapshot_file);
+  skipped.openJournal(journal_file);
+  check(sameEntries(skipped, vectors_, features_, 51, erased), "the entries already in the snapshot are skipped");
+}
+
+void testTrailingRecords(const OrbVocabulary& vocabulary_,
+                         const std::vector<BowVector>& vectors_,
+                         const std::vector<FeatureVector>& features_) {
+  std::remove(journal_file.c_str());
+  std::string nine_entries, complete;
+  {
+    //ds every record is flushed as soon as it is written
+    OrbDatabase database(vocabulary_);
+    database.openJournal(journal_file);
+    for (size_t i = 0; i < 9; ++i) {
+      database.add(vectors_[i], features_[i]);
+    }
+    nine_entries = readFile(journal_file);
+    database.add(vectors_[9], features_[9]);
+    complete = readFile(journal_file);
+  }
+
+  //ds records cut at any byte, as left by a crash while writing them
+  for (size_t cut = nine_entries.size() + 1; cut < complete.size(); cut += 3) {
+    writeFile(journal_file, complete.substr(0, cut));
+
+    OrbDatabase recovered(vocabulary_);
+    recovered.openJournal(journal_file);
+    check(sameEntries(recovered, vectors_, features_, 9, {}), "a truncated record is discarded");
+    check(readFile(journal_file) == nine_entries, "the journal is repaired up to the last complete record");
+    check(!fileExists(journal_file + ".tmp"), "the repaired journal replaces its temporary file");
+
+    //ds the next records are appended after the repaired ones
+    recovered.add(vectors_[9], features_[9]);
+    recovered.closeJournal();
+    OrbDatabase again(vocabulary_);
+    again.openJournal(journal_file);
+    check(sameEntries(again, vectors_, features_, 10, {}), "records are appended to a repaired journal");
+  }
+
+  //ds a record whose data do not match its checksum
+  std::string corrupt = complete;
+  corrupt[corrupt.size() - 1] ^= 1;
+  writeFile(journal_file, corrupt);
+  OrbDatabase recovered(vocabulary_);
+  recovered.openJournal(journal_file);
+  check(sameEntries(recovered, vectors_, features_, 9, {}), "a corrupt trailing record is discarded");
+  check(readFile(journal_file) == nine_entries, "the corrupt record is removed from the journal");
+}
+
+void testVersion1(const OrbVocabulary& vocabulary_,
+                  const std::vector<BowVector>& vectors_,
+                  const std::vector<FeatureVector>& features_) {
+  std::remove(journal_file.c_str());
+  std::remove(snapshot_file.c_str());
+  {
+    OrbDatabase database(vocabulary_);
+    database.openJournal(journal_file);
+    for (size_t i = 0; i < 10; ++i) {
+      database.add(vectors_[i], features_[i]);
+    }
+  }
+
+  //ds version 1 records are the same without their type, JOURNAL_ADD
+  const std::string version2 = readFile(journal_file);
+  JournalDatabase::Header header;
+  std::memcpy(&header, version2.data(), sizeof(header));
+  header.version = 1;
+  std::string version1(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (size_t pos = sizeof(header); pos < version2.size(); ) {
+    uint32_t bytes;
+    std::memcpy(&bytes, version2.data() + pos, sizeof(bytes));
+    const std::string data = version2.substr(pos + sizeof(bytes) + sizeof(uint64_t) + 1, bytes - 1);
+    const uint32_t new_bytes = bytes - 1;
+    const uint64_t checksum = BinaryIO::checksum(data.data(), data.size());
+    version1.append(reinterpret_cast<const char*>(&new_bytes), sizeof(new_bytes));
+    version1.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+    version1.append(data);
+    pos += sizeof(bytes) + sizeof(uint64_t) + bytes;
+  }
+  writeFile(journal_file, version1);
+
+  OrbDatabase recovered(vocabulary_);
+  recovered.openJournal(journal_file);
+  check(sameEntries(recovered, vectors_, features_, 10, {}), "a version 1 journal is replayed");
+
+  //ds erase fails, and leaves the database as it was
+  bool rejected = false;
+  try {
+    recovered.erase(4);
+  } catch (const std::string&) {
+    rejected = true;
+  }
+  check(rejected && !recovered.isErased(4), "a version 1 journal rejects erase");
+
+  //ds added entries are still appended to it
+  recovered.add(vectors_[10], features_[10]);
+  {
+    OrbDatabase again(vocabulary_);
+    again.openJournal(journal_file);
+    check(sameEntries(again, vectors_, features_, 11, {}), "entries are appended to a version 1 journal");
+  }
+
+  //ds a checkpoint starts a journal that supports erase
+  recovered.checkpoint(snapshot_file);
+  recovered.erase(4);
+  recovered.closeJournal();
+  OrbDatabase renewed;
+  renewed.loadBinary(snapshot_file);
+  renewed.openJournal(journal_file);
+  check(sameEntries(renewed, vectors_, features_, 11, {4}), "the renewed journal records erased entries");
+}
@@ -0,0 +1,185 @@
+/**
+ * File: test_posting_codec.cpp
+ * Description: checks the compression of the inverted files of the
+ *   databases: PostingCodec blocks and compressed rows around block
+ *   boundaries
+ * License: see the LICENSE.txt file
+ */
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+// DBoW2
+#include "DBoW2.h" // defines OrbVocabulary and OrbDatabase
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+#include "test_utils.h"
+
+using namespace DBoW2;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void testIdBits(std::mt19937& generator_);
+void testWeights(std::mt19937& generator_);
+void testBlockBoundaries(std::mt19937& generator_);
+
+int32_t main() {
+  std::mt19937 generator(0);
+
+  testIdBits(generator);
+  testWeights(generator);
+  testBlockBoundaries(generator);
+
+  return reportChecks();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//ds encodes and decodes a block, returning the decoded postings
+void roundTrip(const std::vector<EntryId>& entry_ids_,
+               const std::vector<WordValue>& word_weights_,
+               const PostingCompression compression_,
+               PostingBlock& block_,
+               std::vector<EntryId>& decoded_ids_,
+               std::vector<WordValue>& decoded_weights_) {
+  //ds decode reads up to 8 bytes past each id, which stay inside MAX_BYTES
+  std::vector<unsigned char> data(PostingCodec::MAX_BYTES + 8, 0);
+  PostingCodec::encode(entry_ids_.data(), word_weights_.data(), compression_, block_, data.data());
+  decoded_ids_.resize(PostingCodec::BLOCK);
+  decoded_weights_.resize(PostingCodec::BLOCK);
+  PostingCodec::decode(block_, data.data(), decoded_ids_.data(), decoded_weights_.data());
+}
+
+void testIdBits(std::mt19937& generator_) {
+  const size_t n = PostingCodec::BLOCK;
+  const unsigned int widths[] = {0, 1, 7, 8, 9, 15, 16, 17, 24, 31, 32};
+
+  for (const unsigned int bits: widths) {
+    //ds ids whose largest difference needs exactly the given number of bits
+    const uint64_t max_delta = (bits == 0 ? 0 : (uint64_t(1) << bits) - 1);
+    std::vector<EntryId> entry_ids(n);
+    entry_ids[0] = static_cast<EntryId>(generator_() % 1000);
+    uint64_t last = entry_ids[0];
+    for (size_t i = 1; i < n; ++i) {
+      //ds the largest difference goes first, so that it always fits
+      uint64_t delta = (i == 1 ? max_delta : generator_() % (max_delta + 1));
+      if (last + delta > 0xffffffffu) {
+        delta = 0;
+      }
+      last += delta;
+      entry_ids[i] = static_cast<EntryId>(last);
+    }
+    if (bits == 32) {
+      //ds the largest difference that fits in an entry id
+      entry_ids.assign(n, 0xffffffffu);
+      entry_ids[0] = 0;
+    }
+
+    std::vector<WordValue> word_weights(n, 1);
+    for (const PostingCompression compression: {COMPRESSED_16, COMPRESSED_8}) {
+      PostingBlock block;
+      std::vector<EntryId> decoded_ids;
+      std::vector<WordValue> decoded_weights;
+      roundTrip(entry_ids, word_weights, compression, block, decoded_ids, decoded_weights);
+      check(block.id_bits == bits, "id bits are the fewest that hold the largest difference");
+      check(decoded_ids == entry_ids, "entry ids are decoded exactly");
+    }
+  }
+}
+
+void testWeights(std::mt19937& generator_) {
+  const size_t n = PostingCodec::BLOCK;
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  std::vector<EntryId> entry_ids(n);
+  for (size_t i = 0; i < n; ++i) {
+    entry_ids[i] = static_cast<EntryId>(3 * i);
+  }
+
+  for (const PostingCompression compression: {COMPRESSED_16, COMPRESSED_8}) {
+    const double steps = (compression == COMPRESSED_8 ? 255 : 65535);
+
+    //ds weights of very different magnitudes, zeros and tiny non-zero ones
+    std::vector<WordValue> word_weights(n);
+    for (size_t i = 0; i < n; ++i) {
+      word_weights[i] = static_cast<WordValue>(uniform(generator_) * 0.25);
+    }
+    word_weights[0] = 0;
+    word_weights[1] = static_cast<WordValue>(1e-9);
+    word_weights[2] = static_cast<WordValue>(0.5 / steps * 0.9);
+    word_weights[n - 1] = static_cast<WordValue>(0.5);
+
+    PostingBlock block;
+    std::vector<EntryId> decoded_ids;
+    std::vector<WordValue> decoded_weights;
+    roundTrip(entry_ids, word_weights, compression, block, decoded_ids, decoded_weights);
+
+    check(block.weight_bits == (compression == COMPRESSED_8 ? 8 : 16), "weight bits");
+    check(std::fabs(block.scale * steps - 0.5) < 1e-6, "the largest weight is the largest quantized value");
+    check(decoded_weights[0] == 0, "zero weights are decoded as zero");
+    check(decoded_weights[1] > 0 && decoded_weights[2] > 0, "non-zero weights are not decoded as zero");
+    for (size_t i = 3; i < n; ++i) {
+      check(std::fabs(decoded_weights[i] - word_weights[i]) <= block.scale * 0.5 + 1e-9,
+            "weights are rounded to the closest step");
+    }
+
+    //ds a block of zero weights
+    std::vector<WordValue> zeros(n, 0);
+    roundTrip(entry_ids, zeros, compression, block, decoded_ids, decoded_weights);
+    check(decoded_weights == zeros, "a block of zero weights is decoded as zeros");
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void testBlockBoundaries(std::mt19937& generator_) {
+  //ds a small vocabulary to build the databases
+  OrbVocabulary voc(4, 2, TF_IDF, L1_NORM);
+  createVocabulary(generator_, voc);
+  if (voc.size() < 2) {
+    check(false, "vocabulary created");
+    return;
+  }
+
+  //ds rows with as many postings as a block, and one less or more
+  const size_t sizes[] = {1, 63, 64, 65, 127, 128, 129, 200};
+  std::uniform_real_distribution<double> uniform(0.01, 1);
+
+  for (const size_t entries: sizes) {
+    std::vector<BowVector> vectors(entries);
+    for (size_t i = 0; i < entries; ++i) {
+      //ds every entry has word 0, so that row has one posting per entry
+      vectors[i].addWeight(0, static_cast<WordValue>(uniform(generator_)));
+      vectors[i].addWeight(1, static_cast<WordValue>(uniform(generator_)));
+      vectors[i].normalize(L1);
+    }
+
+    for (const PostingCompression compression: {COMPRESSED_16, COMPRESSED_8}) {
+      OrbDatabase plain(voc, false), compressed(voc, false);
+      compressed.setCompression(compression);
+      for (size_t i = 0; i < entries; ++i) {
+        plain.add(vectors[i]);
+        compressed.add(vectors[i]);
+      }
+
+      for (size_t q = 0; q < entries; q += 13) {
+        QueryResults expected, results;
+        plain.query(vectors[q], expected, 0);
+        compressed.query(vectors[q], results, 0);
+        check(results.size() == expected.size(), "every entry of the row is found");
+
+        //ds the scores are approximated, so only the entries are compared
+        std::vector<EntryId> expected_ids, ids;
+        for (size_t i = 0; i < expected.size(); ++i) expected_ids.push_back(expected[i].Id);
+        for (size_t i = 0; i < results.size(); ++i) ids.push_back(results[i].Id);
+        std::sort(expected_ids.begin(), expected_ids.end());
+        std::sort(ids.begin(), ids.end());
+        check(ids == expected_ids, "the same entries are found in compressed rows");
+      }
+    }
+  }
+}
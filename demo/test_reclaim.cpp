@@ -0,0 +1,130 @@
+/**
+ * File: test_reclaim.cpp
+ * Description: checks that the arrays of the inverted file replaced by
+ *   add and compact are freed while other threads keep querying the
+ *   database
+ * License: see the LICENSE.txt file
+ */
+#include <iostream>
+#include <vector>
+#include <random>
+#include <thread>
+#include <atomic>
+
+// DBoW2
+#include "DBoW2.h" // defines OrbVocabulary and OrbDatabase
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+#include "test_utils.h"
+
+using namespace DBoW2;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void createVectors(std::mt19937& generator_,
+                   const unsigned int number_of_words_,
+                   const size_t number_of_vectors_,
+                   std::vector<BowVector>& vectors_);
+void testCompactWhileQuerying(const OrbVocabulary& vocabulary_,
+                              const std::vector<BowVector>& vectors_);
+
+int32_t main() {
+  std::mt19937 generator(0);
+
+  OrbVocabulary vocabulary(4, 2, TF_IDF, L1_NORM);
+  createVocabulary(generator, vocabulary);
+  if (vocabulary.size() < 8) {
+    check(false, "vocabulary created");
+  } else {
+    std::vector<BowVector> vectors;
+    createVectors(generator, vocabulary.size(), 100, vectors);
+    testCompactWhileQuerying(vocabulary, vectors);
+  }
+
+  return reportChecks();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//ds random bow vectors with a few words each
+void createVectors(std::mt19937& generator_,
+                   const unsigned int number_of_words_,
+                   const size_t number_of_vectors_,
+                   std::vector<BowVector>& vectors_) {
+  std::uniform_int_distribution<unsigned int> word(0, number_of_words_ - 1);
+  std::uniform_real_distribution<double> weight(0.01, 1);
+
+  vectors_.resize(number_of_vectors_);
+  for (size_t i = 0; i < number_of_vectors_; ++i) {
+    vectors_[i].clear();
+    for (int j = 0; j < 6; ++j) {
+      vectors_[i].addIfNotExist(word(generator_), static_cast<WordValue>(weight(generator_)));
+    }
+    vectors_[i].normalize(L1);
+  }
+}
+
+void testCompactWhileQuerying(const OrbVocabulary& vocabulary_,
+                              const std::vector<BowVector>& vectors_) {
+  OrbDatabase database(vocabulary_, false);
+  database.add(vectors_[0]);
+
+  //ds several threads keep querying, so there is almost always a query in flight
+  const size_t number_of_readers = 4;
+  std::atomic<bool> stop(false);
+  std::atomic<size_t> number_of_queries[number_of_readers];
+  std::vector<std::thread> readers;
+  for (size_t t = 0; t < number_of_readers; ++t) {
+    number_of_queries[t].store(0);
+    readers.push_back(std::thread([&database, &vectors_, &stop, &number_of_queries, t]() {
+      QueryResults results;
+      for (size_t i = t; !stop.load(); ++i) {
+        database.query(vectors_[i % vectors_.size()], results, 5);
+        ++number_of_queries[t];
+      }
+    }));
+  }
+
+  //ds every cycle adds entries, erases the old ones and compacts the
+  //ds rows, which replaces the arrays of every word
+  for (int cycle = 0; cycle < 20; ++cycle) {
+    for (size_t i = 0; i < 500; ++i) {
+      database.add(vectors_[i % vectors_.size()]);
+    }
+    for (EntryId id = 0; id + 200 < database.size(); ++id) {
+      if (!database.isErased(id)) {
+        database.erase(id);
+      }
+    }
+    while (!database.compact(1)) {
+    }
+
+    //ds once every reader has started a new query, no query can be reading
+    //ds the arrays retired until now, although other queries are in flight
+    size_t queries[number_of_readers];
+    for (size_t t = 0; t < number_of_readers; ++t) {
+      queries[t] = number_of_queries[t].load();
+    }
+    for (size_t t = 0; t < number_of_readers; ++t) {
+      while (number_of_queries[t].load() < queries[t] + 2) {
+        std::this_thread::yield();
+      }
+    }
+
+    //ds the next change frees them, so only the arrays it retires remain
+    const BowVector& vector = vectors_[cycle % vectors_.size()];
+    database.add(vector);
+    check(database.getRetiredArrays() <= vector.size(), "the retired arrays are freed while queries are in flight");
+  }
+
+  stop = true;
+  for (std::thread& reader: readers) {
+    reader.join();
+  }
+
+  //ds without queries, the next change frees all the retired arrays
+  database.add(vectors_[0]);
+  check(database.getRetiredArrays() == 0, "the retired arrays are freed when no query is in flight");
+}
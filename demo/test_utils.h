@@ -0,0 +1,53 @@
+/**
+ * File: test_utils.h
+ * Description: checks and data shared by the test programs
+ * License: see the LICENSE.txt file
+ */
+#ifndef __D_T_TEST_UTILS__
+#define __D_T_TEST_UTILS__
+
+#include <iostream>
+#include <vector>
+#include <random>
+
+// DBoW2
+#include "DBoW2.h" // defines OrbVocabulary
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+//ds number of failed checks
+static int number_of_failures = 0;
+
+inline void check(const bool condition_, const char* what_) {
+  if (!condition_) {
+    std::cout << "FAILED: " << what_ << std::endl;
+    ++number_of_failures;
+  }
+}
+
+//ds prints the summary of the checks and returns the exit code of the test
+inline int32_t reportChecks() {
+  std::cout << (number_of_failures == 0 ? "all checks passed" : "some checks failed")
+            << std::endl;
+  return (number_of_failures == 0 ? 0 : 1);
+}
+
+//ds a small vocabulary trained with 10 images of 100 random ORB descriptors
+inline void createVocabulary(std::mt19937& generator_, OrbVocabulary& vocabulary_) {
+  std::vector<std::vector<DBoW2::FORB::TDescriptor> > training_features(10);
+  for (size_t i = 0; i < training_features.size(); ++i) {
+    training_features[i].resize(100);
+    for (size_t j = 0; j < training_features[i].size(); ++j) {
+      training_features[i][j].create(1, DBoW2::FORB::L, CV_8U);
+      unsigned char* p = training_features[i][j].ptr<unsigned char>();
+      for (int b = 0; b < DBoW2::FORB::L; ++b) {
+        p[b] = static_cast<unsigned char>(generator_());
+      }
+    }
+  }
+  vocabulary_.setSeed(0);
+  vocabulary_.create(training_features);
+}
+
+#endif
@@ -0,0 +1,182 @@
+/**
+ * File: BinaryIO.h
+ * Description: helper functions to read and write binary files
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_BINARY_IO__
+#define __D_T_BINARY_IO__
+
+#include <iostream>
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+namespace DBoW2 {
+
+/// Functions to read and write binary data and check its integrity
+/**
+ * The data are written with the byte order of the machine. The files
+ * created with this class store a byte order mark so that readers can
+ * detect files written on a machine with a different byte order.
+ * Errors are reported by throwing a std::string
+ */
+class BinaryIO
+{
+public:
+
+  /// Value to write to detect the byte order
+  static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+  /// Initial value of checksums
+  static const uint64_t CHECKSUM_SEED = 14695981039346656037ULL;
+
+  /// Alignment of the arrays stored in binary files, so that they can be
+  /// used in place when the files are mapped into memory
+  static const size_t ALIGNMENT = 8;
+
+  /**
+   * Returns the number of bytes that must follow some data so that the
+   * next data start at a multiple of ALIGNMENT
+   * @param bytes size of data
+   * @return padding bytes
+   */
+  static inline size_t padding(size_t bytes)
+  {
+    return (ALIGNMENT - bytes % ALIGNMENT) % ALIGNMENT;
+  }
+
+  /**
+   * Computes the checksum of some data: a 64-bit FNV-1a hash over 64-bit
+   * words (and the remaining bytes). It can be computed in several steps
+   * by passing the previous result as the seed
+   * @param data
+   * @param bytes size of data
+   * @param seed previous checksum
+   * @return checksum
+   */
+  static uint64_t checksum(const void *data, size_t bytes,
+    uint64_t seed = CHECKSUM_SEED);
+
+  /**
+   * Writes some data
+   * @param out output stream
+   * @param data
+   * @param bytes size of data
+   */
+  static void write(std::ostream &out, const void *data, size_t bytes);
+
+  /**
+   * Reads some data
+   * @param in input stream
+   * @param data (out) buffer
+   * @param bytes number of bytes to read
+   */
+  static void read(std::istream &in, void *data, size_t bytes);
+
+  /**
+   * Writes some data and updates a running checksum with them
+   * @param out output stream
+   * @param data
+   * @param bytes size of data
+   * @param checksum (in/out) checksum of the data written before
+   */
+  static void write(std::ostream &out, const void *data, size_t bytes,
+    uint64_t &checksum);
+
+  /**
+   * Reads some data and updates a running checksum with them
+   * @param in input stream
+   * @param data (out) buffer
+   * @param bytes number of bytes to read
+   * @param checksum (in/out) checksum of the data read before
+   */
+  static void read(std::istream &in, void *data, size_t bytes,
+    uint64_t &checksum);
+
+  /**
+   * Skips some data
+   * @param in input stream
+   * @param bytes number of bytes to skip
+   */
+  static void skip(std::istream &in, size_t bytes);
+
+  /**
+   * Appends an integer to a buffer with a variable-length encoding:
+   * 7 bits per byte, from the least significant ones, with the high bit
+   * set in all the bytes but the last one
+   * @param v value
+   * @param buffer (in/out) buffer
+   */
+  static void encodeVarint(uint32_t v, std::vector<unsigned char> &buffer);
+
+  /**
+   * Decodes an integer encoded by encodeVarint
+   * @param p first byte of the value
+   * @param end end of the buffer
+   * @param v (out) value
+   * @return pointer to the byte that follows the value
+   */
+  static const unsigned char* decodeVarint(const unsigned char *p,
+    const unsigned char *end, uint32_t &v);
+
+  /**
+   * Writes an integer encoded by encodeVarint
+   * @param out output stream
+   * @param v value
+   * @param checksum (in/out) running checksum
+   */
+  static void writeVarint(std::ostream &out, uint32_t v, uint64_t &checksum);
+
+  /**
+   * Reads an integer written by writeVarint
+   * @param in input stream
+   * @param checksum (in/out) running checksum
+   * @return value
+   */
+  static uint32_t readVarint(std::istream &in, uint64_t &checksum);
+
+  /**
+   * Writes the zeros that must follow some data to align the next data
+   * @param out output stream
+   * @param bytes size of the data written before
+   */
+  static void writePadding(std::ostream &out, size_t bytes);
+
+  /**
+   * Skips the padding written by writePadding
+   * @param in input stream
+   * @param bytes size of the data read before
+   */
+  static void skipPadding(std::istream &in, size_t bytes);
+
+  /**
+   * Writes a value of a plain type
+   * @param out output stream
+   * @param v value
+   */
+  template<class T>
+  static inline void writeValue(std::ostream &out, const T &v)
+  {
+    write(out, &v, sizeof(T));
+  }
+
+  /**
+   * Reads a value of a plain type
+   * @param in input stream
+   * @return value
+   */
+  template<class T>
+  static inline T readValue(std::istream &in)
+  {
+    T v;
+    read(in, &v, sizeof(T));
+    return v;
+  }
+};
+
+} // namespace DBoW2
+
+#endif
+
@@ -11,7 +11,7 @@
 #define __D_T_BOW_VECTOR__
 
 #include <iostream>
-#include <map>
+#include <utility>
 #include <vector>
 
 namespace DBoW2 {
@@ -19,8 +19,14 @@ namespace DBoW2 {
 /// Id of words
 typedef unsigned int WordId;
 
-/// Value of a word
+/// Value of a word. Building with DBOW2_FLOAT_WORD_VALUE defined (cmake
+/// option DBoW2_FLOAT_WORD_VALUE) stores the weights in single precision,
+/// which halves the memory of the bow vectors and the inverted files
+#ifdef DBOW2_FLOAT_WORD_VALUE
+typedef float WordValue;
+#else
 typedef double WordValue;
+#endif
 
 /// Id of nodes in the vocabulary treee
 typedef unsigned int NodeId;
@@ -53,8 +59,17 @@ enum ScoringType
 };
 
 /// Vector of words to represent images
+/**
+ * The words are stored in a contiguous array of (word id, value) pairs in
+ * ascending order of word id, which is iterated like the std::map it used to
+ * be. It cannot be indexed with operator[] or at(), which would read the
+ * array by position and not by word id; words are looked up with find.
+ * addWeight and addIfNotExist keep the vector sorted; to build a vector
+ * from many words, it is faster to append them with pushWord and to call
+ * sortAndMerge once
+ */
 class BowVector: 
-	public std::map<WordId, WordValue>
+	public std::vector<std::pair<WordId, WordValue> >
 {
 public:
 
@@ -83,6 +98,47 @@ public:
 	 */
 	void addIfNotExist(WordId id, WordValue v);
 
+	/**
+	 * Appends a word at the end of the vector, even if it is out of order or
+	 * already exists. sortAndMerge must be called before using the vector
+	 * @param id word id
+	 * @param v value of the word
+	 */
+	inline void pushWord(WordId id, WordValue v)
+	{
+	  push_back(value_type(id, v));
+	}
+
+	/**
+	 * Sorts the words by id and merges the repeated ones
+	 * @param accumulate if true, the values of a repeated word are added up
+	 *   (as addWeight); otherwise, only the first value appended is kept (as
+	 *   addIfNotExist)
+	 */
+	void sortAndMerge(bool accumulate);
+
+	/**
+	 * Returns the first word whose id is not less than the given one
+	 * @param id word id
+	 * @return iterator to the word, or end()
+	 */
+	iterator lower_bound(WordId id);
+	const_iterator lower_bound(WordId id) const;
+
+	/**
+	 * Looks for a word
+	 * @param id word id
+	 * @return iterator to the word, or end() if it is not in the vector
+	 */
+	iterator find(WordId id);
+	const_iterator find(WordId id) const;
+
+	/// Indexing by position is disabled, since v[id] looks like a word lookup
+	reference operator[](size_type) = delete;
+	const_reference operator[](size_type) const = delete;
+	reference at(size_type) = delete;
+	const_reference at(size_type) const = delete;
+
 	/**
 	 * L1-Normalizes the values in the vector 
 	 * @param norm_type norm used
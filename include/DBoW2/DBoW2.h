@@ -51,12 +51,15 @@ namespace DBoW2
 
 #include "TemplatedVocabulary.h"
 #include "TemplatedDatabase.h"
+#include "TemplatedShardedDatabase.h"
 #include "BowVector.h"
 #include "FeatureVector.h"
 #include "QueryResults.h"
 #include "FBrief.h"
 #include "FORB.h"
 #include "FBinaryDescriptor.h"
+#include "FBinary256.h"
+#include "Hamming.h"
 
 /// ORB Vocabulary
 typedef DBoW2::TemplatedVocabulary<DBoW2::FORB::TDescriptor, DBoW2::FORB> 
@@ -65,6 +68,10 @@ typedef DBoW2::TemplatedVocabulary<DBoW2::FORB::TDescriptor, DBoW2::FORB>
 /// FORB Database
 typedef DBoW2::TemplatedDatabase<DBoW2::FORB::TDescriptor, DBoW2::FORB> 
   OrbDatabase;
+
+/// FORB sharded Database
+typedef DBoW2::TemplatedShardedDatabase<DBoW2::FORB::TDescriptor, DBoW2::FORB>
+  OrbShardedDatabase;
   
 /// BRIEF Vocabulary
 typedef DBoW2::TemplatedVocabulary<DBoW2::FBrief::TDescriptor, DBoW2::FBrief> 
@@ -74,6 +81,22 @@ typedef DBoW2::TemplatedVocabulary<DBoW2::FBrief::TDescriptor, DBoW2::FBrief>
 typedef DBoW2::TemplatedDatabase<DBoW2::FBrief::TDescriptor, DBoW2::FBrief> 
   BriefDatabase;
 
+/// BRIEF sharded Database
+typedef DBoW2::TemplatedShardedDatabase<DBoW2::FBrief::TDescriptor, DBoW2::FBrief>
+  BriefShardedDatabase;
+
+/// 256-bit binary descriptor Vocabulary (loads ORB vocabulary files)
+typedef DBoW2::TemplatedVocabulary<DBoW2::FBinary256::TDescriptor, DBoW2::FBinary256>
+  Binary256Vocabulary;
+
+/// 256-bit binary descriptor Database
+typedef DBoW2::TemplatedDatabase<DBoW2::FBinary256::TDescriptor, DBoW2::FBinary256>
+  Binary256Database;
+
+/// 256-bit binary descriptor sharded Database
+typedef DBoW2::TemplatedShardedDatabase<DBoW2::FBinary256::TDescriptor, DBoW2::FBinary256>
+  Binary256ShardedDatabase;
+
 /// generic binary descriptor Vocabulary
 typedef DBoW2::TemplatedVocabulary<DBoW2::FBinaryDescriptor::TDescriptor, DBoW2::FBinaryDescriptor>
   BinaryDescriptorVocabulary;
@@ -82,5 +105,9 @@ typedef DBoW2::TemplatedVocabulary<DBoW2::FBinaryDescriptor::TDescriptor, DBoW2:
 typedef DBoW2::TemplatedDatabase<DBoW2::FBinaryDescriptor::TDescriptor, DBoW2::FBinaryDescriptor>
   BinaryDescriptorDatabase;
 
+/// generic binary descriptor sharded Database
+typedef DBoW2::TemplatedShardedDatabase<DBoW2::FBinaryDescriptor::TDescriptor, DBoW2::FBinaryDescriptor>
+  BinaryDescriptorShardedDatabase;
+
 #endif
 
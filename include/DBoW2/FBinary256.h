@@ -0,0 +1,134 @@
+/**
+ * File: FBinary256.h
+ * Description: functions for 256-bit binary descriptors (e.g. ORB) stored
+ *   inline as four 64-bit words
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_F_BINARY_256__
+#define __D_T_F_BINARY_256__
+
+#include <opencv2/core.hpp>
+#include <array>
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "FClass.h"
+
+namespace DBoW2 {
+
+/// Functions to manipulate 256-bit binary descriptors without heap storage
+/**
+ * The descriptors keep the same bytes as a 32-byte ORB descriptor, so
+ * vocabularies saved with FORB can be loaded with this class and vice versa
+ */
+class FBinary256: protected FClass
+{
+public:
+
+  /// Descriptor type (the 32 bytes of the descriptor, in memory order)
+  typedef std::array<uint64_t, 4> TDescriptor;
+  /// Pointer to a single descriptor
+  typedef const TDescriptor *pDescriptor;
+  /// Descriptor length (in bytes)
+  static const int L = 32;
+
+  /**
+   * Calculates the mean value of a set of descriptors
+   * @param descriptors
+   * @param mean mean descriptor
+   */
+  static void meanValue(const std::vector<pDescriptor> &descriptors, 
+    TDescriptor &mean);
+  
+  /**
+   * Calculates the distance between two descriptors
+   * @param a
+   * @param b
+   * @return distance
+   */
+  static double distance(const TDescriptor &a, const TDescriptor &b);
+  
+  /**
+   * Calculates the distances between one descriptor and a set of them
+   * @param a
+   * @param b array of n descriptors
+   * @param n number of descriptors in b
+   * @param d (out) array of n distances, d[i] is the distance from a to b[i]
+   */
+  static void distances(const TDescriptor &a, const TDescriptor *b, int n,
+    double *d);
+
+  /**
+   * Calculates the distances between the binary versions of a descriptor
+   * and a set of them, as written by toArray8U
+   * @param a binary version of a descriptor
+   * @param b n binary versions of descriptors, one after the other
+   * @param bytes size of each binary version
+   * @param n number of descriptors in b
+   * @param d (out) array of n distances, d[i] is the distance from a to the
+   *   i-th descriptor of b
+   */
+  static void distances8U(const unsigned char *a, const unsigned char *b,
+    int bytes, int n, double *d);
+  
+  /**
+   * Returns a string version of the descriptor (same format as FORB)
+   * @param a descriptor
+   * @return string version
+   */
+  static std::string toString(const TDescriptor &a);
+  
+  /**
+   * Returns a descriptor from a string (same format as FORB)
+   * @param a descriptor
+   * @param s string version
+   */
+  static void fromString(TDescriptor &a, const std::string &s);
+
+  /**
+   * Returns the number of bytes of the binary version of a descriptor
+   * @param a descriptor
+   * @return number of bytes
+   */
+  static int size8U(const TDescriptor &a);
+
+  /**
+   * Writes the binary version of a descriptor
+   * @param a descriptor
+   * @param p (out) buffer of size8U(a) bytes
+   */
+  static void toArray8U(const TDescriptor &a, unsigned char *p);
+
+  /**
+   * Returns a descriptor from its binary version
+   * @param a (out) descriptor
+   * @param p buffer written by toArray8U
+   * @param bytes size of the buffer
+   */
+  static void fromArray8U(TDescriptor &a, const unsigned char *p, int bytes);
+
+  /**
+   * Returns the descriptors stored in an OpenCV matrix
+   * @param mat NxL CV_8U matrix (e.g. computed by cv::ORB)
+   * @param descriptors (out) vector of N descriptors
+   */
+  static void fromMat8U(const cv::Mat &mat, 
+    std::vector<TDescriptor> &descriptors);
+
+  /**
+   * Returns a matrix with the descriptor in OpenCV format
+   * @param descriptors vector of N descriptors
+   * @param mat (out) NxL CV_8U matrix
+   */
+  static void toMat8U(const std::vector<TDescriptor> &descriptors, 
+    cv::Mat &mat);
+
+};
+
+} // namespace DBoW2
+
+#endif
+
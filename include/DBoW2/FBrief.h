@@ -43,6 +43,29 @@ public:
    */
   static double distance(const TDescriptor &a, const TDescriptor &b);
   
+  /**
+   * Calculates the distances between one descriptor and a set of them
+   * @param a
+   * @param b array of n descriptors
+   * @param n number of descriptors in b
+   * @param d (out) array of n distances, d[i] is the distance from a to b[i]
+   */
+  static void distances(const TDescriptor &a, const TDescriptor *b, int n,
+    double *d);
+
+  /**
+   * Calculates the distances between the binary versions of a descriptor
+   * and a set of them, as written by toArray8U
+   * @param a binary version of a descriptor
+   * @param b n binary versions of descriptors, one after the other
+   * @param bytes size of each binary version
+   * @param n number of descriptors in b
+   * @param d (out) array of n distances, d[i] is the distance from a to the
+   *   i-th descriptor of b
+   */
+  static void distances8U(const unsigned char *a, const unsigned char *b,
+    int bytes, int n, double *d);
+  
   /**
    * Returns a string version of the descriptor
    * @param a descriptor
@@ -56,6 +79,28 @@ public:
    * @param s string version
    */
   static void fromString(TDescriptor &a, const std::string &s);
+
+  /**
+   * Returns the number of bytes of the binary version of a descriptor
+   * @param a descriptor
+   * @return number of bytes
+   */
+  static int size8U(const TDescriptor &a);
+
+  /**
+   * Writes the binary version of a descriptor
+   * @param a descriptor
+   * @param p (out) buffer of size8U(a) bytes
+   */
+  static void toArray8U(const TDescriptor &a, unsigned char *p);
+
+  /**
+   * Returns a descriptor from its binary version
+   * @param a (out) descriptor
+   * @param p buffer written by toArray8U
+   * @param bytes size of the buffer
+   */
+  static void fromArray8U(TDescriptor &a, const unsigned char *p, int bytes);
 };
 
 } // namespace DBoW2
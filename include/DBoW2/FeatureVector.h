@@ -11,18 +11,201 @@
 #define __D_T_FEATURE_VECTOR__
 
 #include "BowVector.h"
-#include <map>
+#include <cstddef>
+#include <iterator>
+#include <utility>
 #include <vector>
 #include <iostream>
 
 namespace DBoW2 {
 
+/// Indexes of the local features of a node of a FeatureVector
+/**
+ * It points into the storage of the FeatureVector, so it is only valid
+ * while the vector is not modified
+ */
+class FeatureIndices
+{
+public:
+
+  typedef const unsigned int* const_iterator;
+  typedef const unsigned int* iterator;
+
+  /**
+   * Creates an empty range
+   */
+  FeatureIndices(): m_begin(NULL), m_end(NULL) {}
+
+  /**
+   * Creates a range of indexes
+   * @param begin first index
+   * @param end one past the last index
+   */
+  FeatureIndices(const unsigned int *begin, const unsigned int *end):
+    m_begin(begin), m_end(end) {}
+
+  /**
+   * Returns the number of indexes
+   * @return size
+   */
+  inline size_t size() const { return m_end - m_begin; }
+
+  /**
+   * Returns whether there are no indexes
+   * @return true iff size() == 0
+   */
+  inline bool empty() const { return m_begin == m_end; }
+
+  /**
+   * Returns an index
+   * @param i position (< size())
+   * @return index of a local feature
+   */
+  inline unsigned int operator[](size_t i) const { return m_begin[i]; }
+
+  inline const_iterator begin() const { return m_begin; }
+  inline const_iterator end() const { return m_end; }
+
+  inline unsigned int front() const { return *m_begin; }
+  inline unsigned int back() const { return *(m_end - 1); }
+
+  /**
+   * Copies the indexes into a vector
+   * @return vector with the indexes
+   */
+  inline operator std::vector<unsigned int>() const
+  {
+    return std::vector<unsigned int>(m_begin, m_end);
+  }
+
+protected:
+
+  /// First index
+  const unsigned int *m_begin;
+  /// One past the last index
+  const unsigned int *m_end;
+};
+
 /// Vector of nodes with indexes of local features
-class FeatureVector: 
-  public std::map<NodeId, std::vector<unsigned int> >
+/**
+ * The nodes are stored in ascending order of id in a flat array, and the
+ * indexes of the features of all of them in a single array, where node i
+ * has the range [offsets[i], offsets[i+1]). It is iterated like the
+ * std::map<NodeId, std::vector<unsigned int> > it used to be, but the
+ * features of each node are given as a FeatureIndices range.
+ * addFeature keeps the vector sorted, and is fast when the nodes are added
+ * in ascending order; to build a vector from features of nodes in any
+ * order, it is faster to append them with pushFeature and to call
+ * sortAndMerge once
+ */
+class FeatureVector
 {
 public:
 
+  /// Node and indexes of its features
+  typedef std::pair<NodeId, FeatureIndices> value_type;
+
+  /// Iterator over the nodes, in ascending order of id
+  /**
+   * The nodes are not stored as pairs, so dereferencing the iterator builds
+   * a value_type and returns it by value; it->second is a view into the
+   * vector that must be copied, not bound to a reference. Since the
+   * reference type is not a real reference, the iterator is only an input
+   * iterator for the standard algorithms, although it can be moved by any
+   * offset
+   */
+  class const_iterator
+  {
+  public:
+
+    typedef std::input_iterator_tag iterator_category;
+    typedef FeatureVector::value_type value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef value_type reference;
+
+    /// Gives access to the members of the value, which is built on the fly
+    struct pointer
+    {
+      value_type value;
+      inline const value_type* operator->() const { return &value; }
+    };
+
+    const_iterator(): m_fv(NULL), m_i(0) {}
+
+    const_iterator(const FeatureVector *fv, size_t i): m_fv(fv), m_i(i) {}
+
+    inline value_type operator*() const { return m_fv->at(m_i); }
+    inline pointer operator->() const
+    {
+      pointer p = { m_fv->at(m_i) };
+      return p;
+    }
+    inline value_type operator[](difference_type d) const
+    {
+      return m_fv->at(m_i + d);
+    }
+
+    inline const_iterator& operator++() { ++m_i; return *this; }
+    inline const_iterator& operator--() { --m_i; return *this; }
+    inline const_iterator operator++(int)
+    {
+      const_iterator it = *this; ++m_i; return it;
+    }
+    inline const_iterator operator--(int)
+    {
+      const_iterator it = *this; --m_i; return it;
+    }
+    inline const_iterator& operator+=(difference_type d)
+    {
+      m_i += d; return *this;
+    }
+    inline const_iterator& operator-=(difference_type d)
+    {
+      m_i -= d; return *this;
+    }
+    inline const_iterator operator+(difference_type d) const
+    {
+      return const_iterator(m_fv, m_i + d);
+    }
+    inline const_iterator operator-(difference_type d) const
+    {
+      return const_iterator(m_fv, m_i - d);
+    }
+    inline difference_type operator-(const const_iterator &it) const
+    {
+      return (difference_type)m_i - (difference_type)it.m_i;
+    }
+
+    inline bool operator==(const const_iterator &it) const
+    {
+      return m_i == it.m_i;
+    }
+    inline bool operator!=(const const_iterator &it) const
+    {
+      return m_i != it.m_i;
+    }
+    inline bool operator<(const const_iterator &it) const
+    {
+      return m_i < it.m_i;
+    }
+
+    /**
+     * Returns the position of the node in the vector
+     * @return index
+     */
+    inline size_t index() const { return m_i; }
+
+  protected:
+
+    /// Vector iterated
+    const FeatureVector *m_fv;
+    /// Position of the node
+    size_t m_i;
+  };
+
+  /// The content of the nodes cannot be modified through iterators
+  typedef const_iterator iterator;
+
   /**
    * Constructor
    */
@@ -41,16 +224,133 @@ public:
    */
   void addFeature(NodeId id, unsigned int i_feature);
 
+  /**
+   * Appends a feature without keeping the vector sorted. The vector must
+   * have been cleared and only filled with pushFeature, and sortAndMerge
+   * must be called before using it
+   * @param id node id
+   * @param i_feature index of the feature
+   */
+  inline void pushFeature(NodeId id, unsigned int i_feature)
+  {
+    m_nodes.push_back(id);
+    m_features.push_back(i_feature);
+  }
+
+  /**
+   * Groups the features appended with pushFeature by node. The features of
+   * each node keep the order in which they were appended
+   */
+  void sortAndMerge();
+
+  /**
+   * Returns the number of nodes
+   * @return size
+   */
+  inline size_t size() const { return m_nodes.size(); }
+
+  /**
+   * Returns whether the vector has no nodes
+   * @return true iff size() == 0
+   */
+  inline bool empty() const { return m_nodes.empty(); }
+
+  /**
+   * Returns the total number of features of all the nodes
+   * @return number of feature indexes
+   */
+  inline size_t features() const { return m_features.size(); }
+
+  /**
+   * Allocates memory for a number of nodes and features
+   * @param nodes
+   * @param features
+   */
+  void reserve(size_t nodes, size_t features);
+
+  /**
+   * Removes all the nodes, but keeps the memory allocated
+   */
+  void clear();
+
+  /**
+   * Swaps the content of two vectors
+   * @param fv
+   */
+  void swap(FeatureVector &fv);
+
+  inline const_iterator begin() const { return const_iterator(this, 0); }
+  inline const_iterator end() const { return const_iterator(this, size()); }
+
+  /**
+   * Returns a node
+   * @param i position of the node (< size())
+   * @return node id and indexes of its features
+   */
+  inline value_type at(size_t i) const
+  {
+    const unsigned int *f = m_features.data();
+    return value_type(m_nodes[i],
+      FeatureIndices(f + m_offsets[i], f + m_offsets[i+1]));
+  }
+
+  /**
+   * Returns the first node whose id is not less than the given one
+   * @param id node id
+   * @return iterator to the node, or end()
+   */
+  const_iterator lower_bound(NodeId id) const;
+
+  /**
+   * Looks for a node
+   * @param id node id
+   * @return iterator to the node, or end() if it is not in the vector
+   */
+  const_iterator find(NodeId id) const;
+
+  /**
+   * Returns the indexes of the features of a node
+   * @param id node id
+   * @return indexes, empty if the node is not in the vector
+   */
+  FeatureIndices featuresOf(NodeId id) const;
+
+  /**
+   * Compares two vectors
+   * @param fv
+   * @return true iff both have the same nodes with the same features
+   */
+  inline bool operator==(const FeatureVector &fv) const
+  {
+    return m_nodes == fv.m_nodes && m_offsets == fv.m_offsets &&
+      m_features == fv.m_features;
+  }
+
+  inline bool operator!=(const FeatureVector &fv) const
+  {
+    return !(*this == fv);
+  }
+
   /**
    * Sends a string versions of the feature vector through the stream
    * @param out stream
    * @param v feature vector
    */
   friend std::ostream& operator<<(std::ostream &out, const FeatureVector &v);
-    
+
+protected:
+
+  /// Ids of the nodes, in ascending order
+  std::vector<NodeId> m_nodes;
+
+  /// Position of the first feature of each node in m_features, and the total
+  /// number of features at the end (empty if there are no nodes)
+  std::vector<unsigned int> m_offsets;
+
+  /// Indexes of the features of all the nodes
+  std::vector<unsigned int> m_features;
 };
 
 } // namespace DBoW2
 
 #endif
-
@@ -0,0 +1,69 @@
+/**
+ * File: Hamming.h
+ * Description: Hamming distance kernels for 256-bit binary descriptors,
+ *   selected at run time according to the instruction sets of the CPU
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_HAMMING__
+#define __D_T_HAMMING__
+
+namespace DBoW2 {
+
+/// Functions to compute Hamming distances between 256-bit descriptors
+/**
+ * The descriptors are given as pointers to 32 bytes, which do not need to
+ * be aligned. The implementation (AVX-512 VPOPCNTDQ, AVX2, POPCNT or
+ * portable code) is chosen the first time a distance is computed
+ */
+class Hamming
+{
+public:
+
+  /// Descriptor length (in bytes)
+  static const int L = 32;
+
+  /**
+   * Calculates the distance between two descriptors
+   * @param a
+   * @param b
+   * @return number of different bits
+   */
+  static int distance256(const unsigned char *a, const unsigned char *b);
+
+  /**
+   * Calculates the distances between one descriptor and a set of them
+   * @param a query descriptor
+   * @param b array of n pointers to descriptors
+   * @param n number of descriptors in b
+   * @param d (out) array of n distances, d[i] is the distance from a to b[i]
+   */
+  static void distances256(const unsigned char *a,
+    const unsigned char * const *b, int n, int *d);
+
+  /**
+   * Calculates the distances between one descriptor and a set of them
+   * stored one after the other, with any number of bytes. Descriptors of
+   * L bytes are given to the same kernels as distances256
+   * @param a query descriptor
+   * @param b array of n descriptors of the given size, one after the other
+   * @param bytes size of each descriptor
+   * @param n number of descriptors in b
+   * @param d (out) array of n distances, d[i] is the distance from a to the
+   *   i-th descriptor of b
+   */
+  static void distances8U(const unsigned char *a, const unsigned char *b,
+    int bytes, int n, int *d);
+
+  /**
+   * Returns the name of the implementation in use
+   * @return "avx512", "avx2", "popcnt" or "generic"
+   */
+  static const char* implementation();
+};
+
+} // namespace DBoW2
+
+#endif
+
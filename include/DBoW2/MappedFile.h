@@ -0,0 +1,69 @@
+/**
+ * File: MappedFile.h
+ * Description: read-only file mapped into memory
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_MAPPED_FILE__
+#define __D_T_MAPPED_FILE__
+
+#include <string>
+#include <cstddef>
+
+namespace DBoW2 {
+
+/// Whole file mapped into memory for reading
+/**
+ * The pages of the file are read by the operating system when they are
+ * accessed, and they are shared by all the processes that map the same
+ * file. Only POSIX systems are supported: in other systems, the
+ * constructor throws an error. Errors are reported by throwing a
+ * std::string
+ */
+class MappedFile
+{
+public:
+
+  /**
+   * Maps a file
+   * @param filename
+   */
+  explicit MappedFile(const std::string &filename);
+
+  /**
+   * Unmaps the file
+   */
+  ~MappedFile();
+
+  /**
+   * Returns the content of the file
+   * @return pointer to the first byte (NULL if the file is empty)
+   */
+  inline const unsigned char* data() const { return m_data; }
+
+  /**
+   * Returns the size of the file
+   * @return bytes
+   */
+  inline size_t size() const { return m_size; }
+
+protected:
+
+  // not copyable
+  MappedFile(const MappedFile &);
+  MappedFile& operator=(const MappedFile &);
+
+protected:
+
+  /// Content of the file
+  const unsigned char *m_data;
+
+  /// Size of the file
+  size_t m_size;
+};
+
+} // namespace DBoW2
+
+#endif
+
@@ -0,0 +1,162 @@
+/**
+ * File: PostingCodec.h
+ * Description: compression of blocks of postings of the inverted files
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_POSTING_CODEC__
+#define __D_T_POSTING_CODEC__
+
+#include <cstddef>
+#include <stdint.h>
+
+#include "BowVector.h"
+#include "QueryResults.h"
+
+namespace DBoW2 {
+
+/// Storage of the inverted files of the databases
+enum PostingCompression
+{
+  /// Entry ids and weights as they are
+  UNCOMPRESSED,
+  /// Blocks of bit-packed entry ids and weights quantized to 16 bits
+  COMPRESSED_16,
+  /// Blocks of bit-packed entry ids and weights quantized to 8 bits
+  COMPRESSED_8
+};
+
+/// Header of a compressed block of postings
+struct PostingBlock
+{
+  /// Id of the first entry of the block
+  EntryId first;
+  /// Position of the data of the block in the data of its row
+  uint32_t offset;
+  /// Weight of a quantization step
+  float scale;
+  /// Bits of the difference between each entry id and the previous one
+  uint8_t id_bits;
+  /// Bits of the quantized weights (8 or 16)
+  uint8_t weight_bits;
+};
+
+/// Encodes and decodes blocks of postings
+/**
+ * A block stores BLOCK postings. The differences between consecutive entry
+ * ids are packed with the same number of bits, the fewest that hold the
+ * largest one, and the weights are rounded to multiples of a step, so that
+ * the largest weight of the block is stored as the largest quantized value.
+ * The data of a block are the packed ids (BLOCK * id_bits / 8 bytes)
+ * followed by the quantized weights. As the width of the ids is fixed, they
+ * are decoded without branches. The weights are only approximated, with a
+ * relative error up to 1/510 (8 bits) or 1/131070 (16 bits) of the largest
+ * weight of the block, but the non-zero weights smaller than half a step
+ * are stored as one step, so they are never decoded as 0
+ */
+class PostingCodec
+{
+public:
+
+  /// Postings of each block
+  static const size_t BLOCK = 64;
+
+  /// Maximum number of bytes of the data of a block
+  static const size_t MAX_BYTES = BLOCK * sizeof(EntryId) + BLOCK * 2;
+
+  /**
+   * Encodes BLOCK postings. Their weights must be non-negative
+   * @param entry_ids ascending entry ids
+   * @param word_weights weights of the entries
+   * @param compression COMPRESSED_16 or COMPRESSED_8
+   * @param block (out) header of the block (but its offset)
+   * @param data (out) buffer with room for MAX_BYTES bytes
+   * @return number of bytes written into data
+   */
+  static size_t encode(const EntryId *entry_ids,
+    const WordValue *word_weights, PostingCompression compression,
+    PostingBlock &block, unsigned char *data);
+
+  /**
+   * Decodes a block
+   * @param block header of the block
+   * @param data data of the block
+   * @param entry_ids (out) array of BLOCK entry ids
+   * @param word_weights (out) array of BLOCK weights
+   */
+  static inline void decode(const PostingBlock &block,
+    const unsigned char *data, EntryId *entry_ids, WordValue *word_weights);
+
+  /**
+   * Decodes the entry ids of a block
+   * @param block header of the block
+   * @param data data of the block
+   * @param entry_ids (out) array of BLOCK entry ids
+   */
+  static inline void decodeIds(const PostingBlock &block,
+    const unsigned char *data, EntryId *entry_ids);
+
+protected:
+
+  /**
+   * Reads 8 bytes as a little-endian integer
+   * @param p first byte, which does not need to be aligned
+   * @return value
+   */
+  static inline uint64_t load64(const unsigned char *p)
+  {
+    // compilers turn this into a single load in little-endian machines
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+      ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+      ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+      ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+  }
+};
+
+// --------------------------------------------------------------------------
+
+inline void PostingCodec::decodeIds(const PostingBlock &block,
+  const unsigned char *data, EntryId *entry_ids)
+{
+  // the 8 bytes read for each id are inside the block, since the weights
+  // follow the ids
+  const unsigned int bits = block.id_bits;
+  const uint64_t mask = ((uint64_t)1 << bits) - 1;
+
+  EntryId eid = block.first;
+  for(size_t i = 0; i < BLOCK; ++i)
+  {
+    const size_t bit = i * bits;
+    eid += (EntryId)((load64(data + bit / 8) >> (bit % 8)) & mask);
+    entry_ids[i] = eid;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+inline void PostingCodec::decode(const PostingBlock &block,
+  const unsigned char *data, EntryId *entry_ids, WordValue *word_weights)
+{
+  decodeIds(block, data, entry_ids);
+
+  const unsigned char *w = data + BLOCK * block.id_bits / 8;
+  const WordValue scale = block.scale;
+
+  if(block.weight_bits == 8)
+  {
+    for(size_t i = 0; i < BLOCK; ++i) word_weights[i] = w[i] * scale;
+  }
+  else
+  {
+    for(size_t i = 0; i < BLOCK; ++i)
+      word_weights[i] = (w[2*i] | (w[2*i + 1] << 8)) * scale;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
+#endif
+
@@ -144,6 +144,30 @@ public:
   }
   
   
+  /**
+   * Compares the scores of two results, and the entry ids if the scores
+   * are equal
+   * @param a
+   * @param b
+   * @return true iff a.Score < b.Score, or a.Score == b.Score and a.Id < b.Id
+   */
+  static inline bool ltScoreId(const Result &a, const Result &b)
+  {
+    return a.Score < b.Score || (a.Score == b.Score && a.Id < b.Id);
+  }
+  
+  /**
+   * Compares the scores of two results, and the entry ids if the scores
+   * are equal
+   * @param a
+   * @param b
+   * @return true iff a.Score > b.Score, or a.Score == b.Score and a.Id < b.Id
+   */
+  static inline bool gtScoreId(const Result &a, const Result &b)
+  {
+    return a.Score > b.Score || (a.Score == b.Score && a.Id < b.Id);
+  }
+  
   /**
    * Returns true iff a.Id < b.Id
    * @param a
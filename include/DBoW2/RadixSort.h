@@ -0,0 +1,82 @@
+/**
+ * File: RadixSort.h
+ * Description: stable sort of items by integer keys
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_RADIX_SORT__
+#define __D_T_RADIX_SORT__
+
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+namespace DBoW2 {
+
+/// Stable sort of items by unsigned integer keys
+/**
+ * The keys are sorted one byte at a time, from the least significant one,
+ * so the cost is linear in the number of items and in the number of bytes
+ * of the largest key. The items with the same key keep their order
+ */
+class RadixSort
+{
+public:
+
+  /**
+   * Sorts items by key
+   * @param items items to sort
+   * @param buffer auxiliar array. Its content is lost, but its memory is
+   *   kept, so the same buffer can be used to sort many times without
+   *   allocating memory
+   * @param key function that returns the key (uint32_t) of an item
+   * @param max_key largest key of the items
+   */
+  template<class T, class Key>
+  static void sort(std::vector<T> &items, std::vector<T> &buffer, Key key,
+    uint32_t max_key);
+};
+
+// --------------------------------------------------------------------------
+
+template<class T, class Key>
+void RadixSort::sort(std::vector<T> &items, std::vector<T> &buffer, Key key,
+  uint32_t max_key)
+{
+  const size_t n = items.size();
+  if(n < 2) return;
+
+  buffer.resize(n);
+
+  size_t count[256];
+  for(unsigned int shift = 0; shift < 32 && (max_key >> shift) != 0;
+    shift += 8)
+  {
+    std::fill(count, count + 256, 0);
+    for(size_t i = 0; i < n; ++i) ++count[(key(items[i]) >> shift) & 0xff];
+
+    // nothing to do if all the items have the same digit
+    if(count[(key(items[0]) >> shift) & 0xff] == n) continue;
+
+    size_t pos = 0;
+    for(int d = 0; d < 256; ++d)
+    {
+      const size_t c = count[d];
+      count[d] = pos;
+      pos += c;
+    }
+
+    for(size_t i = 0; i < n; ++i)
+      buffer[count[(key(items[i]) >> shift) & 0xff]++] = items[i];
+
+    items.swap(buffer);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
+#endif
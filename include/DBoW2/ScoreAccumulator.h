@@ -0,0 +1,106 @@
+/**
+ * File: ScoreAccumulator.h
+ * Description: dense accumulator of partial scores of database entries
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_SCORE_ACCUMULATOR__
+#define __D_T_SCORE_ACCUMULATOR__
+
+#include <vector>
+#include <algorithm>
+
+#include "QueryResults.h"
+
+namespace DBoW2 {
+
+/// @param T type of the values accumulated per entry
+template<class T>
+/// Dense array of values indexed by entry id, with the list of entries
+/// touched since the last reset
+/**
+ * Accessing an entry for the first time after a reset sets its value to
+ * T() and adds it to the touched list. Resetting does not clear the array:
+ * each entry stores the generation it was last touched in, so a reset is
+ * O(1) and the memory is reused by the next query
+ */
+class ScoreAccumulator
+{
+public:
+
+  /**
+   * Creates an empty accumulator
+   */
+  ScoreAccumulator(): m_generation(0) {}
+
+  /**
+   * Forgets the touched entries and makes room for entries with id < n
+   * @param n number of entries
+   */
+  void reset(size_t n)
+  {
+    m_touched.resize(0);
+
+    if(++m_generation == 0)
+    {
+      // the stamps wrapped around
+      std::fill(m_stamps.begin(), m_stamps.end(), 0);
+      m_generation = 1;
+    }
+
+    if(m_values.size() < n)
+    {
+      m_values.resize(n);
+      m_stamps.resize(n, 0);
+    }
+  }
+
+  /**
+   * Returns the value of an entry, touching it
+   * @param eid entry id (must be below the size given to reset)
+   * @return reference to the value
+   */
+  inline T& operator[](EntryId eid)
+  {
+    if(m_stamps[eid] != m_generation)
+    {
+      m_stamps[eid] = m_generation;
+      m_values[eid] = T();
+      m_touched.push_back(eid);
+    }
+    return m_values[eid];
+  }
+
+  /**
+   * Returns the value of a touched entry
+   * @param eid entry id
+   * @return value
+   */
+  inline const T& value(EntryId eid) const { return m_values[eid]; }
+
+  /**
+   * Returns the entries touched since the last reset
+   * @return entry ids, in the order they were touched
+   */
+  inline const std::vector<EntryId>& touched() const { return m_touched; }
+
+protected:
+
+  /// Values of the entries
+  std::vector<T> m_values;
+
+  /// Generation when each entry was touched last
+  std::vector<unsigned int> m_stamps;
+
+  /// Current generation
+  unsigned int m_generation;
+
+  /// Entries touched in this generation
+  std::vector<EntryId> m_touched;
+};
+
+} // namespace DBoW2
+
+#endif
+
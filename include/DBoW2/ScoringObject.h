@@ -35,10 +35,8 @@ public:
    */
   virtual bool mustNormalize(LNorm &norm) const = 0;
 
-  /// Log of epsilon
+  /// Log of the epsilon of WordValue (this is needed by the KL method)
 	static const double LOG_EPS; 
-  // If you change the type of WordValue, make sure you change also the
-	// epsilon value (this is needed by the KL method)
 	
   virtual ~GeneralScoring() {} //!< Required for virtual base classes	
 };
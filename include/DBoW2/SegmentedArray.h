@@ -0,0 +1,224 @@
+/**
+ * File: SegmentedArray.h
+ * Description: array whose elements never move in memory
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_SEGMENTED_ARRAY__
+#define __D_T_SEGMENTED_ARRAY__
+
+#include <cstddef>
+#include <algorithm>
+
+namespace DBoW2 {
+
+/// @param T type of the elements
+template<class T>
+/// Array whose elements never move in memory
+/**
+ * The elements are stored in segments of growing size: the first one has
+ * room for FIRST elements, and each next one is as large as all the
+ * previous ones together. Growing the array only allocates new segments,
+ * so a thread can append elements while other threads access the existing
+ * ones, and references to the elements stay valid until they are removed.
+ * All the elements of a segment are default-constructed when the segment
+ * is allocated
+ */
+class SegmentedArray
+{
+public:
+
+  /**
+   * Creates an empty array
+   */
+  SegmentedArray(): m_size(0)
+  {
+    std::fill(m_segments, m_segments + SEGMENTS, (T*)NULL);
+  }
+
+  /**
+   * Copy constructor
+   * @param a
+   */
+  SegmentedArray(const SegmentedArray &a): m_size(0)
+  {
+    std::fill(m_segments, m_segments + SEGMENTS, (T*)NULL);
+    *this = a;
+  }
+
+  /**
+   * Destructor
+   */
+  ~SegmentedArray() { clear(); }
+
+  /**
+   * Copies the elements of another array
+   * @param a
+   * @return reference to this array
+   */
+  SegmentedArray& operator=(const SegmentedArray &a)
+  {
+    if(this != &a)
+    {
+      clear();
+      resize(a.size());
+      for(size_t i = 0; i < a.size(); ++i) (*this)[i] = a[i];
+    }
+    return *this;
+  }
+
+  /**
+   * Returns the number of elements
+   * @return size
+   */
+  inline size_t size() const { return m_size; }
+
+  /**
+   * Returns whether the array is empty
+   * @return true iff size() == 0
+   */
+  inline bool empty() const { return m_size == 0; }
+
+  /**
+   * Returns an element
+   * @param i index (< size())
+   * @return reference to the element
+   */
+  inline T& operator[](size_t i)
+  {
+    size_t offset;
+    const int s = segment(i, offset);
+    return m_segments[s][offset];
+  }
+
+  /**
+   * Returns an element
+   * @param i index (< size())
+   * @return reference to the element
+   */
+  inline const T& operator[](size_t i) const
+  {
+    size_t offset;
+    const int s = segment(i, offset);
+    return m_segments[s][offset];
+  }
+
+  /**
+   * Appends an element
+   * @param v
+   */
+  void push_back(const T &v)
+  {
+    reserve(m_size + 1);
+    (*this)[m_size] = v;
+    ++m_size;
+  }
+
+  /**
+   * Changes the number of elements. New elements are default-constructed,
+   * and removed elements are reset to T(), but their memory is not freed
+   * (see clear)
+   * @param n new size
+   */
+  void resize(size_t n)
+  {
+    reserve(n);
+    for(size_t i = n; i < m_size; ++i) (*this)[i] = T();
+    m_size = n;
+  }
+
+  /**
+   * Allocates the segments needed to store n elements
+   * @param n
+   */
+  void reserve(size_t n)
+  {
+    if(n == 0) return;
+
+    size_t offset;
+    const int last = segment(n - 1, offset);
+    for(int s = 0; s <= last; ++s)
+    {
+      if(m_segments[s] == NULL) m_segments[s] = new T[capacity(s)];
+    }
+  }
+
+  /**
+   * Removes all the elements and frees their memory
+   */
+  void clear()
+  {
+    for(int s = 0; s < SEGMENTS; ++s)
+    {
+      delete [] m_segments[s];
+      m_segments[s] = NULL;
+    }
+    m_size = 0;
+  }
+
+  /**
+   * Swaps the content of two arrays
+   * @param a
+   */
+  void swap(SegmentedArray &a)
+  {
+    std::swap_ranges(m_segments, m_segments + SEGMENTS, a.m_segments);
+    std::swap(m_size, a.m_size);
+  }
+
+protected:
+
+  /// Bits of the index of the elements of the first segment
+  static const int FIRST_BITS = 8;
+
+  /// Elements of the first segment
+  static const size_t FIRST = (size_t)1 << FIRST_BITS;
+
+  /// Maximum number of segments
+  static const int SEGMENTS = 48;
+
+  /**
+   * Returns the capacity of a segment
+   * @param s segment index
+   * @return number of elements
+   */
+  static inline size_t capacity(int s)
+  {
+    return (s == 0 ? FIRST : FIRST << (s - 1));
+  }
+
+  /**
+   * Returns the segment where an element is stored
+   * @param i index of the element
+   * @param offset (out) position of the element in the segment
+   * @return segment index
+   */
+  static inline int segment(size_t i, size_t &offset)
+  {
+    if(i < FIRST)
+    {
+      offset = i;
+      return 0;
+    }
+
+    // segment s > 0 starts at index FIRST << (s - 1)
+    int s = 1;
+    while((i >> (FIRST_BITS + s)) != 0) ++s;
+    offset = i - (FIRST << (s - 1));
+    return s;
+  }
+
+protected:
+
+  /// Segments of elements (NULL if not allocated)
+  T* m_segments[SEGMENTS];
+
+  /// Number of elements
+  size_t m_size;
+};
+
+} // namespace DBoW2
+
+#endif
+
@@ -0,0 +1,612 @@
+/**
+ * File: TemplatedShardedDatabase.h
+ * Description: database split in shards that are queried in parallel
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_TEMPLATED_SHARDED_DATABASE__
+#define __D_T_TEMPLATED_SHARDED_DATABASE__
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include "TemplatedDatabase.h"
+#include "SegmentedArray.h"
+#include "ThreadPool.h"
+#include "QueryResults.h"
+#include "BowVector.h"
+#include "FeatureVector.h"
+
+namespace DBoW2 {
+
+/// @param TDescriptor class of descriptor
+/// @param F class of descriptor functions
+template<class TDescriptor, class F>
+/// Database whose entries are split in several TemplatedDatabase shards
+/**
+ * All the shards use the same vocabulary object. The entries have global
+ * ids, assigned in the order they are added, and each one is stored in a
+ * shard chosen when it is added: by default, the shard with fewest
+ * entries, so the shards stay balanced, but entries can be grouped by
+ * session, id range, etc. by giving the shard explicitly.
+ * A query runs on all the shards in parallel, and their best results are
+ * merged. The results are the same as with a single TemplatedDatabase
+ * with the same entries.
+ * As in TemplatedDatabase, one thread can add entries while other threads
+ * query the database
+ */
+class TemplatedShardedDatabase
+{
+public:
+
+  /// Shard type
+  typedef TemplatedDatabase<TDescriptor, F> Shard;
+
+  /**
+   * Creates an empty database with the given vocabulary
+   * @param T class inherited from TemplatedVocabulary<TDescriptor, F>
+   * @param voc vocabulary, copied once and shared by the shards
+   * @param shards number of shards (0: as many as hardware threads)
+   * @param use_di a direct index is used to store feature indexes
+   * @param di_levels levels to go up the vocabulary tree to select the
+   *   node id to store in the direct index when adding images
+   */
+  template<class T>
+  explicit TemplatedShardedDatabase(const T &voc, int shards = 0,
+    bool use_di = true, int di_levels = 0);
+
+  /**
+   * Destructor
+   */
+  virtual ~TemplatedShardedDatabase();
+
+  /**
+   * Adds an entry to the database and returns its global id
+   * @param features features of the new entry
+   * @param bowvec if given, the bow vector of these features is returned
+   * @param fvec if given, the vector of nodes and feature indexes is returned
+   * @param shard shard to store the entry in. < 0 means the shard with
+   *   fewest entries
+   * @return id of new entry
+   */
+  EntryId add(const std::vector<TDescriptor> &features,
+    BowVector *bowvec = NULL, FeatureVector *fvec = NULL, int shard = -1);
+
+  /**
+   * Adds an entry to the database and returns its global id
+   * @param vec bow vector
+   * @param fec feature vector to add the entry. Only necessary if using the
+   *   direct index
+   * @param shard shard to store the entry in. < 0 means the shard with
+   *   fewest entries
+   * @return id of new entry
+   */
+  EntryId add(const BowVector &vec,
+    const FeatureVector &fec = FeatureVector(), int shard = -1);
+
+  /**
+   * Empties the database
+   */
+  void clear();
+
+  /**
+   * Marks an entry as erased in its shard (see TemplatedDatabase::erase)
+   * @param id global entry id (must be < size())
+   */
+  void erase(EntryId id);
+
+  /**
+   * Returns whether an entry has been erased
+   * @param id global entry id (must be < size())
+   * @return true iff the entry is erased
+   */
+  inline bool isErased(EntryId id) const
+  {
+    const std::pair<int, EntryId> &location = m_locations[id];
+    return m_shards[location.first]->isErased(location.second);
+  }
+
+  /**
+   * Removes the erased entries from the indexes of all the shards, in
+   * parallel (see TemplatedDatabase::compact)
+   * @param max_rows maximum number of rows of the inverted file of each
+   *   shard to process in this call. 0 means all the remaining ones
+   * @return true iff the compaction of all the shards finished
+   */
+  bool compact(unsigned int max_rows = 0);
+
+  /**
+   * Sets how the inverted files of the shards are stored, rebuilding them
+   * in parallel (see TemplatedDatabase::setCompression)
+   * @param compression
+   */
+  void setCompression(PostingCompression compression);
+
+  /**
+   * Returns how the inverted files of the shards are stored
+   * @return compression
+   */
+  inline PostingCompression getCompression() const 
+  { 
+    return m_shards[0]->getCompression(); 
+  }
+
+  /**
+   * Returns the number of entries in the database
+   * @return number of entries in all the shards
+   */
+  inline unsigned int size() const;
+
+  /**
+   * Returns the number of shards
+   * @return number of shards
+   */
+  inline int getShards() const { return (int)m_shards.size(); }
+
+  /**
+   * Returns a shard. The ids of its entries are local to the shard
+   * (see getGlobalId)
+   * @param s shard index
+   * @return shard
+   */
+  inline const Shard& getShard(int s) const { return *m_shards[s]; }
+
+  /**
+   * Returns the shard where an entry is stored
+   * @param id global entry id (must be < size())
+   * @return shard index
+   */
+  inline int getShardOf(EntryId id) const { return m_locations[id].first; }
+
+  /**
+   * Returns the global id of an entry of a shard
+   * @param s shard index
+   * @param id id of the entry in the shard
+   * @return global entry id
+   */
+  inline EntryId getGlobalId(int s, EntryId id) const
+  {
+    return m_global_ids[s][id];
+  }
+
+  /**
+   * Sets the number of threads used to query, compact and compress the
+   * shards
+   * @param threads number of threads (0: as many as hardware threads).
+   *   By default, as many as shards, up to the number of hardware threads
+   */
+  void setThreads(int threads);
+
+  /**
+   * Returns the number of threads used to query, compact and compress the
+   * shards
+   * @return number of threads (0: as many as hardware threads)
+   */
+  inline int getThreads() const { return m_threads; }
+
+  /**
+   * Returns the pool of threads that run on the shards. It is created 
+   * with getThreads() threads the first time it is needed, and kept until
+   * the number of threads changes
+   * @return pool
+   */
+  std::shared_ptr<ThreadPool> getThreadPool() const;
+
+  /**
+   * Makes the database run on the shards in the given pool, e.g. the one
+   * of the vocabulary. The number of threads becomes the size of the pool
+   * @param pool pool to use. If NULL, a new one is created when needed
+   */
+  void setThreadPool(const std::shared_ptr<ThreadPool> &pool);
+
+  /**
+   * Returns a pointer to the vocabulary used
+   * @return vocabulary
+   */
+  inline const TemplatedVocabulary<TDescriptor,F>* getVocabulary() const
+  {
+    return m_shards[0]->getVocabulary();
+  }
+
+  /**
+   * Checks if the direct index is being used
+   * @return true iff using direct index
+   */
+  inline bool usingDirectIndex() const
+  {
+    return m_shards[0]->usingDirectIndex();
+  }
+
+  /**
+   * Returns the di levels when using direct index
+   * @return di levels
+   */
+  inline int getDirectIndexLevels() const
+  {
+    return m_shards[0]->getDirectIndexLevels();
+  }
+
+  /**
+   * Queries the database with some features
+   * @param features query features
+   * @param ret (out) query results, with global entry ids
+   * @param max_results number of results to return. <= 0 means all
+   * @param max_id only entries with global id < max_id are returned.
+   *   < 0 means all
+   */
+  void query(const std::vector<TDescriptor> &features, QueryResults &ret,
+    int max_results = 1, int max_id = -1) const;
+
+  /**
+   * Queries the database with a vector. The shards are queried in parallel
+   * and their best max_results results are merged
+   * @param vec bow vector already normalized
+   * @param ret (out) query results, with global entry ids
+   * @param max_results number of results to return. <= 0 means all
+   * @param max_id only entries with global id < max_id are returned.
+   *   < 0 means all
+   */
+  void query(const BowVector &vec, QueryResults &ret,
+    int max_results = 1, int max_id = -1) const;
+
+  /**
+   * Returns the feature vector associated with a database entry
+   * @param id global entry id (must be < size())
+   * @return const reference to map of nodes and their associated features in
+   *   the given entry
+   */
+  const FeatureVector& retrieveFeatures(EntryId id) const;
+
+protected:
+
+  /**
+   * Reserves the ids of a new entry before adding it to a shard
+   * @param shard shard given by the user
+   * @param s (out) shard of the entry
+   * @return global id of the entry
+   */
+  EntryId prepareEntry(int shard, int &s);
+
+  /**
+   * Returns the number of entries of a shard with global id < max_id
+   * @param s shard index
+   * @param max_id global id
+   * @return local id of the first entry of the shard with global
+   *   id >= max_id
+   */
+  int localMaxId(int s, EntryId max_id) const;
+
+private:
+
+  /// Not copyable
+  TemplatedShardedDatabase(const TemplatedShardedDatabase &);
+  TemplatedShardedDatabase& operator=(const TemplatedShardedDatabase &);
+
+protected:
+
+  /// Shards
+  std::vector<Shard*> m_shards;
+
+  /// Global ids of the entries of each shard, in ascending order
+  std::vector<SegmentedArray<EntryId> > m_global_ids;
+
+  /// Shard and local id of each entry
+  SegmentedArray<std::pair<int, EntryId> > m_locations;
+
+  /// Number of entries. Entries are visible to the queries once they are
+  /// counted here
+  std::atomic<int> m_nentries;
+
+  /// Number of threads that run on the shards
+  int m_threads;
+
+  /// Pool of threads, created when it is needed (NULL until then)
+  mutable std::shared_ptr<ThreadPool> m_pool;
+
+  /// Protects the creation of m_pool
+  mutable std::mutex m_pool_mutex;
+};
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class T>
+TemplatedShardedDatabase<TDescriptor, F>::TemplatedShardedDatabase
+  (const T &voc, int shards, bool use_di, int di_levels)
+  : m_nentries(0)
+{
+  if(shards <= 0) shards = ThreadPool::hardwareThreads();
+
+  m_shards.resize(shards);
+  m_shards[0] = new Shard(voc, use_di, di_levels);
+  for(int s = 1; s < shards; ++s)
+  {
+    m_shards[s] = new Shard(use_di, di_levels);
+    m_shards[s]->shareVocabulary(*m_shards[0]);
+  }
+
+  m_global_ids.resize(shards);
+
+  m_threads = std::min(shards, ThreadPool::hardwareThreads());
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TemplatedShardedDatabase<TDescriptor, F>::~TemplatedShardedDatabase()
+{
+  for(size_t s = 0; s < m_shards.size(); ++s) delete m_shards[s];
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedShardedDatabase<TDescriptor, F>::setThreads(int threads)
+{
+  std::lock_guard<std::mutex> lock(m_pool_mutex);
+  m_threads = threads;
+  m_pool.reset();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+std::shared_ptr<ThreadPool>
+TemplatedShardedDatabase<TDescriptor, F>::getThreadPool() const
+{
+  std::lock_guard<std::mutex> lock(m_pool_mutex);
+  if(!m_pool) m_pool = std::make_shared<ThreadPool>(m_threads);
+  return m_pool;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedShardedDatabase<TDescriptor, F>::setThreadPool
+  (const std::shared_ptr<ThreadPool> &pool)
+{
+  std::lock_guard<std::mutex> lock(m_pool_mutex);
+  m_pool = pool;
+  if(pool) m_threads = pool->size();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+EntryId TemplatedShardedDatabase<TDescriptor, F>::prepareEntry
+  (int shard, int &s)
+{
+  if(shard >= (int)m_shards.size())
+    throw std::string("Invalid shard index");
+
+  s = shard;
+  if(s < 0)
+  {
+    s = 0;
+    for(int i = 1; i < (int)m_shards.size(); ++i)
+    {
+      if(m_shards[i]->size() < m_shards[s]->size()) s = i;
+    }
+  }
+
+  // the ids are stored before the entry becomes visible in the shard
+  const EntryId entry_id = m_nentries.load(std::memory_order_relaxed);
+  m_global_ids[s].push_back(entry_id);
+  m_locations.push_back(std::make_pair(s, (EntryId)m_shards[s]->size()));
+
+  return entry_id;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+EntryId TemplatedShardedDatabase<TDescriptor, F>::add(
+  const std::vector<TDescriptor> &features,
+  BowVector *bowvec, FeatureVector *fvec, int shard)
+{
+  int s;
+  const EntryId entry_id = prepareEntry(shard, s);
+
+  m_shards[s]->add(features, bowvec, fvec);
+
+  m_nentries.store(entry_id + 1, std::memory_order_release);
+  return entry_id;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+EntryId TemplatedShardedDatabase<TDescriptor, F>::add(const BowVector &v,
+  const FeatureVector &fv, int shard)
+{
+  int s;
+  const EntryId entry_id = prepareEntry(shard, s);
+
+  m_shards[s]->add(v, fv);
+
+  m_nentries.store(entry_id + 1, std::memory_order_release);
+  return entry_id;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedShardedDatabase<TDescriptor, F>::clear()
+{
+  for(size_t s = 0; s < m_shards.size(); ++s)
+  {
+    m_shards[s]->clear();
+    m_global_ids[s].clear();
+  }
+  m_locations.clear();
+  m_nentries = 0;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedShardedDatabase<TDescriptor, F>::erase(EntryId id)
+{
+  assert(id < size());
+  const std::pair<int, EntryId> &location = m_locations[id];
+  m_shards[location.first]->erase(location.second);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedShardedDatabase<TDescriptor, F>::compact(unsigned int max_rows)
+{
+  std::atomic<bool> finished(true);
+  getThreadPool()->parallelFor(0, m_shards.size(), [&](size_t s)
+  {
+    if(!m_shards[s]->compact(max_rows)) finished = false;
+  });
+  return finished;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedShardedDatabase<TDescriptor, F>::setCompression(
+  PostingCompression compression)
+{
+  getThreadPool()->parallelFor(0, m_shards.size(), [&](size_t s)
+  {
+    m_shards[s]->setCompression(compression);
+  });
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline unsigned int TemplatedShardedDatabase<TDescriptor, F>::size() const
+{
+  return m_nentries.load(std::memory_order_acquire);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+int TemplatedShardedDatabase<TDescriptor, F>::localMaxId
+  (int s, EntryId max_id) const
+{
+  // the global ids of a shard are sorted
+  const SegmentedArray<EntryId> &ids = m_global_ids[s];
+  size_t lo = 0, hi = m_shards[s]->size();
+  while(lo < hi)
+  {
+    const size_t mid = (lo + hi) / 2;
+    if(ids[mid] < max_id) lo = mid + 1;
+    else hi = mid;
+  }
+  return (int)lo;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedShardedDatabase<TDescriptor, F>::query(
+  const std::vector<TDescriptor> &features,
+  QueryResults &ret, int max_results, int max_id) const
+{
+  BowVector vec;
+  getVocabulary()->transform(features, vec);
+  query(vec, ret, max_results, max_id);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedShardedDatabase<TDescriptor, F>::query(
+  const BowVector &vec, QueryResults &ret, int max_results, int max_id) const
+{
+  ret.resize(0);
+
+  // entries being added are not visited
+  const int nentries = m_nentries.load(std::memory_order_acquire);
+  if(max_id == -1 || max_id > nentries) max_id = nentries;
+  if(max_id <= 0) return;
+
+  std::vector<QueryResults> parts(m_shards.size());
+
+  getThreadPool()->parallelFor(0, m_shards.size(), [&](size_t s)
+  {
+    const int local_max_id = localMaxId((int)s, (EntryId)max_id);
+    if(local_max_id == 0) return;
+
+    m_shards[s]->query(vec, parts[s], max_results, local_max_id);
+
+    QueryResults::iterator qit;
+    for(qit = parts[s].begin(); qit != parts[s].end(); ++qit)
+      qit->Id = m_global_ids[s][qit->Id];
+  });
+
+  size_t n = 0;
+  for(size_t s = 0; s < parts.size(); ++s) n += parts[s].size();
+
+  ret.reserve(n);
+  for(size_t s = 0; s < parts.size(); ++s)
+    ret.insert(ret.end(), parts[s].begin(), parts[s].end());
+
+  // the shards return the scores already scaled, where greater is better
+  // except for KL. Equal scores are sorted by entry id, as in the shards
+  bool (*cmp)(const Result&, const Result&) =
+    (getVocabulary()->getScoringType() == KL ?
+      Result::ltScoreId : Result::gtScoreId);
+
+  if(max_results > 0 && (int)ret.size() > max_results)
+  {
+    std::partial_sort(ret.begin(), ret.begin() + max_results, ret.end(),
+      cmp);
+    ret.resize(max_results);
+  }
+  else
+  {
+    std::sort(ret.begin(), ret.end(), cmp);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+const FeatureVector& TemplatedShardedDatabase<TDescriptor, F>::retrieveFeatures
+  (EntryId id) const
+{
+  assert(id < size());
+  const std::pair<int, EntryId> &location = m_locations[id];
+  return m_shards[location.first]->retrieveFeatures(location.second);
+}
+
+// --------------------------------------------------------------------------
+
+/**
+ * Writes printable information of the database
+ * @param os stream to write to
+ * @param db
+ */
+template<class TDescriptor, class F>
+std::ostream& operator<<(std::ostream &os,
+  const TemplatedShardedDatabase<TDescriptor,F> &db)
+{
+  os << "Sharded database: Entries = " << db.size() << ", "
+    "Shards = " << db.getShards() << ", "
+    "Using direct index = " << (db.usingDirectIndex() ? "yes" : "no");
+
+  if(db.usingDirectIndex())
+    os << ", Direct index levels = " << db.getDirectIndexLevels();
+
+  os << ". " << *db.getVocabulary();
+  return os;
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
+#endif
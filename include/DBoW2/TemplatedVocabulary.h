@@ -14,14 +14,26 @@
 
 #include <vector>
 #include <numeric>
+#include <limits>
 #include <fstream>
 #include <string>
 #include <algorithm>
+#include <random>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
 #include <opencv2/core.hpp>
 
 #include "FeatureVector.h"
 #include "BowVector.h"
 #include "ScoringObject.h"
+#include "ThreadPool.h"
+#include "BinaryIO.h"
+#include "MappedFile.h"
+#include "RadixSort.h"
+#include "TransformCache.h"
 
 #include <DUtils/DUtils.h>
 
@@ -135,12 +147,74 @@ public:
   virtual void transform(const std::vector<TDescriptor>& features,
     BowVector &v, FeatureVector &fv, int levelsup) const;
 
+  /**
+   * Transforms a set of descriptors into a bow vector, taking the words of
+   * the tracked features from the cache (see setCache) if they are there,
+   * without descending the tree. A tracked feature gets the word of its
+   * track in the cache even if its descriptor has changed
+   * @param features
+   * @param tracks track id of each feature (tracks[i] of features[i]), or
+   *   TransformCache::NO_TRACK for the features that are not tracked
+   * @param v (out) bow vector
+   */
+  void transform(const std::vector<TDescriptor>& features,
+    const std::vector<TrackId> &tracks, BowVector &v) const;
+
+  /**
+   * Transforms a set of descriptors into a bow vector and a feature vector,
+   * taking the words of the tracked features from the cache (see setCache)
+   * if they are there, without descending the tree
+   * @param features
+   * @param tracks track id of each feature (tracks[i] of features[i]), or
+   *   TransformCache::NO_TRACK for the features that are not tracked
+   * @param v (out) bow vector
+   * @param fv (out) feature vector of nodes and feature indexes
+   * @param levelsup levels to go up the vocabulary tree to get the node index
+   */
+  void transform(const std::vector<TDescriptor>& features,
+    const std::vector<TrackId> &tracks, BowVector &v, FeatureVector &fv,
+    int levelsup) const;
+
   /**
    * Transforms a single feature into a word (without weight)
    * @param feature
    * @return word id
    */
   virtual WordId transform(const TDescriptor& feature) const;
+
+  /**
+   * Transforms the features of several images into bow vectors, in
+   * parallel with getThreads() threads
+   * @param features features of each image
+   * @param v (out) bow vectors. v[i] is the vector of features[i]
+   */
+  void transformBatch(const std::vector<std::vector<TDescriptor> > &features,
+    std::vector<BowVector> &v) const;
+
+  /**
+   * Transforms the features of several images into bow vectors and
+   * feature vectors, in parallel with getThreads() threads
+   * @param features features of each image
+   * @param v (out) bow vectors. v[i] is the vector of features[i]
+   * @param fv (out) feature vectors. fv[i] is the vector of features[i]
+   * @param levelsup levels to go up the vocabulary tree to get the node index
+   */
+  void transformBatch(const std::vector<std::vector<TDescriptor> > &features,
+    std::vector<BowVector> &v, std::vector<FeatureVector> &fv,
+    int levelsup) const;
+
+  /**
+   * Transforms the features of n images into bow vectors and, optionally,
+   * feature vectors, in parallel with getThreads() threads. Each image is
+   * converted by calling transform
+   * @param features array of n sets of features
+   * @param n number of images
+   * @param v (out) array of n bow vectors. v[i] is the vector of features[i]
+   * @param fv (out) if given, array of n feature vectors
+   * @param levelsup levels to go up the vocabulary tree to get the node index
+   */
+  void transformBatch(const std::vector<TDescriptor> *features, size_t n,
+    BowVector *v, FeatureVector *fv = NULL, int levelsup = 0) const;
   
   /**
    * Returns the score of two vectors
@@ -223,6 +297,112 @@ public:
    * @param type new scoring type
    */
   void setScoringType(ScoringType type);
+
+  /**
+   * Sets the number of threads used to create the vocabulary and to
+   * transform batches of images
+   * @param threads number of threads (0: as many as hardware threads).
+   *   By default, 1
+   */
+  void setThreads(int threads);
+
+  /**
+   * Returns the number of threads used to create the vocabulary and to
+   * transform batches of images
+   * @return number of threads (0: as many as hardware threads)
+   */
+  inline int getThreads() const { return m_threads; }
+
+  /**
+   * Returns the pool of threads used to create the vocabulary and to
+   * transform batches of images. It is created with getThreads() threads
+   * the first time it is needed, and kept until the number of threads
+   * changes, so that the calls do not start threads every time
+   * @return pool
+   */
+  std::shared_ptr<ThreadPool> getThreadPool() const;
+
+  /**
+   * Makes the vocabulary run its tasks in the given pool, which can be
+   * shared with other vocabularies and databases (e.g.
+   * db.setThreadPool(voc.getThreadPool())). The number of threads becomes
+   * the size of the pool
+   * @param pool pool to use. If NULL, a new one is created when needed
+   */
+  void setThreadPool(const std::shared_ptr<ThreadPool> &pool);
+
+  /**
+   * Sets the seed of the random numbers used to create the vocabulary, so
+   * that the same training features always produce the same vocabulary,
+   * regardless of the number of threads.
+   * If no seed is set, a random one is used each time
+   * @param seed
+   */
+  inline void setSeed(uint64_t seed) { m_seed = seed; m_use_seed = true; }
+
+  /**
+   * Sets how transform looks for the words of the features in the compiled
+   * tree. By default, each feature goes to its closest child at each level,
+   * so a feature near the boundary of two clusters may not reach its
+   * closest word. With a beam wider than 1, the closest beam nodes of each
+   * level are kept, and the children of all of them are compared in the
+   * next level, which finds the closest word more often at about beam times
+   * the cost. With soft assignment (words > 1), each feature is given the
+   * closest words found, and, if the weighting is TF or TF_IDF, its weight
+   * is shared among them in proportion to exp(-(d^2 - d0^2) / (2 sigma^2)),
+   * where d is the distance to each word and d0 that to the closest one.
+   * Stopped words (weight 0) get no share. The feature vectors only get
+   * the closest word of each feature
+   * @param beam nodes kept at each level (1: greedy descent)
+   * @param words words given to each feature (1 <= words <= beam)
+   * @param sigma scale of the distances of soft assignment (0: the weight
+   *   is shared equally)
+   */
+  void setSearch(unsigned int beam, unsigned int words = 1,
+    double sigma = 0);
+
+  /**
+   * Returns the nodes kept at each level when looking for words
+   * @return beam width (1: greedy descent)
+   */
+  inline unsigned int getSearchBeam() const { return m_search_beam; }
+
+  /**
+   * Returns the number of words given to each feature
+   * @return words (1: no soft assignment)
+   */
+  inline unsigned int getSearchWords() const { return m_search_words; }
+
+  /**
+   * Returns the scale of the distances of soft assignment
+   * @return sigma
+   */
+  inline double getSearchSigma() const { return m_search_sigma; }
+
+  /**
+   * Sets a cache of the words of the features transformed, so that the
+   * features seen again (e.g. the same descriptor in consecutive images,
+   * or the same track id) do not descend the tree. The features are
+   * identified by a hash of the bits of their descriptor, or by their
+   * track id. The cache is emptied when the tree, its weights or the search
+   * change, and it is not used with soft assignment
+   * @param capacity maximum number of features in the cache (0: no cache)
+   * @param shards parts of the cache with their own lock, so that several
+   *   threads can use it at the same time
+   */
+  void setCache(size_t capacity, unsigned int shards = 16);
+
+  /**
+   * Removes the words stored in the cache, if any
+   */
+  void clearCache();
+
+  /**
+   * Returns how many features were found in the cache and how many were
+   * not since it was set
+   * @return counters (0 if there is no cache)
+   */
+  TransformCache::Stats getCacheStats() const;
   
   /**
    * Loads the vocabulary from a text file
@@ -257,6 +437,64 @@ public:
    */  
   virtual void load(const cv::FileStorage &fs, 
     const std::string &name = "vocabulary");
+
+  /**
+   * Saves the vocabulary into a file in binary format, which is much
+   * faster to load than the YAML and text formats. The descriptors are
+   * stored with F::toArray8U, and all of them must have the same size
+   * @param filename
+   */
+  void saveBinary(const std::string &filename) const;
+
+  /**
+   * Writes the vocabulary in binary format into a stream
+   * @param out output stream, opened in binary mode
+   */
+  void saveBinary(std::ostream &out) const;
+
+  /**
+   * Loads a vocabulary saved with saveBinary
+   * @param filename
+   */
+  void loadBinary(const std::string &filename);
+
+  /**
+   * Reads a vocabulary in binary format from a stream. The stream is left
+   * at the end of the vocabulary
+   * @param in input stream, opened in binary mode
+   * @param name name of the stream, for the error messages
+   */
+  void loadBinary(std::istream &in, const std::string &name = "stream");
+
+  /**
+   * Maps a file saved with saveBinary into memory and uses it as a
+   * read-only vocabulary. The compiled tree and its descriptors are used
+   * from the file without parsing or copying them, whatever TDescriptor
+   * is: transform compares the features with the bytes of the file
+   * (F::distances8U), and no TDescriptor is built but by getWord.
+   * The pages of the file are shared by all the processes that map it.
+   * Copies of the vocabulary share the mapping.
+   * The tree can be used with transform, getWord, getWordWeight,
+   * getParentNode and getWordsFromNode, and saved with saveBinary, but it
+   * cannot be modified (stopWords) or saved in the other formats
+   * @param filename
+   * @param verify_checksum if true, the checksum of the file is verified,
+   *   which requires reading the whole file
+   */
+  void mapBinary(const std::string &filename, bool verify_checksum = false);
+
+  /**
+   * Returns whether the vocabulary is mapped from a file by mapBinary
+   * @return true iff the vocabulary is read-only
+   */
+  inline bool isMapped() const { return m_mapped.get() != NULL; }
+
+  /**
+   * Returns a checksum of the content of the vocabulary (tree, weights,
+   * words and descriptors). It is the checksum stored by saveBinary
+   * @return checksum
+   */
+  uint64_t getChecksum() const;
   
   /** 
    * Stops those words whose weight is below minWeight.
@@ -272,6 +510,24 @@ public:
    */
   virtual int stopWords(double minWeight);
 
+  /**
+   * Builds the compiled version of the tree that is used by transform.
+   * This is a read-only copy of the tree where the nodes are stored in
+   * breadth-first order, so that the children of each node are contiguous
+   * in memory. Their descriptors are packed in the same order with
+   * F::toArray8U into one aligned array of bytes, which transform compares
+   * with F::distances8U. If the descriptors do not have all the same size,
+   * the tree is not compiled.
+   * It is called automatically after creating or loading the vocabulary
+   */
+  void compile();
+
+  /**
+   * Returns whether the compiled tree is available
+   * @return true iff the vocabulary has been compiled
+   */
+  inline bool isCompiled() const { return m_tree_nodes != NULL; }
+
 protected:
 
   /// Pointer to descriptor
@@ -312,13 +568,287 @@ protected:
     inline bool isLeaf() const { return children.empty(); }
   };
 
+  /// Random number generator used to create the vocabulary
+  typedef std::mt19937_64 RandomEngine;
+
+  /// Subtree built by the hierarchical kmeans, before adding it to m_nodes
+  struct KMeansNode
+  {
+    /// Descriptors of the children
+    std::vector<TDescriptor> clusters;
+    /// Subtrees of the children. It is empty if the children are leaves,
+    /// and a child is a leaf if its subtree has no clusters
+    std::vector<KMeansNode> children;
+  };
+
+  /// Header of the binary files
+  struct BinaryHeader
+  {
+    /// "DBoW2VOC"
+    char magic[8];
+    /// BinaryIO::BYTE_ORDER_MARK
+    uint32_t byte_order;
+    /// Version of the format
+    uint32_t version;
+    /// Branching factor, depth levels, scoring and weighting
+    int32_t k, L, scoring, weighting;
+    /// Bytes of each descriptor
+    uint32_t descriptor_bytes;
+    /// sizeof(WordValue)
+    uint32_t weight_bytes;
+    /// Number of nodes, including the root
+    uint32_t nodes;
+    /// Number of words
+    uint32_t words;
+    /// Checksum of the nodes and the descriptors
+    uint64_t checksum;
+    /// Unused
+    uint32_t reserved[2];
+  };
+
+  /// Node of the compiled tree
+  struct FlatNode
+  {
+    /// Position in the compiled tree of the first child
+    unsigned int first_child;
+    /// Number of children (0 if the node is a word)
+    unsigned int nchildren;
+    /// Id of the node in m_nodes
+    NodeId node_id;
+    /// Word id if the node is a word
+    WordId word_id;
+    /// Weight if the node is a word
+    WordValue weight;
+  };
+
+  /// Compiled tree mapped from a binary file
+  struct MappedTree
+  {
+    /// File with the tree
+    MappedFile file;
+    /// Position in the compiled tree of the parent of each node
+    const uint32_t *parents;
+    /// Position in the compiled tree of each word
+    const uint32_t *words;
+    /// Number of words
+    unsigned int nwords;
+    /// Position in the compiled tree of each node id, built the first time
+    /// a node is looked up by id
+    mutable std::vector<uint32_t> positions;
+    /// Builds positions once
+    mutable std::once_flag positions_once;
+
+    /**
+     * Maps a file
+     * @param filename
+     */
+    MappedTree(const std::string &filename)
+      : file(filename), parents(NULL), words(NULL), nwords(0) {}
+  };
+
+  /// Word of a local feature, while an image is being transformed
+  struct FeatureWord
+  {
+    /// Word id
+    WordId word;
+    /// Id of the node levelsup levels up from the word
+    NodeId node;
+    /// Index of the feature
+    unsigned int feature;
+    /// Weight of the word
+    WordValue weight;
+    /// Whether it is the closest word found for the feature
+    bool closest;
+  };
+
+  /// Node reached by a feature while searching the compiled tree
+  struct SearchNode
+  {
+    /// Distance from the feature to the node
+    double distance;
+    /// Position of the node in the compiled tree
+    unsigned int pos;
+    /// Id of the node levelsup levels up from it
+    NodeId nid;
+  };
+
 protected:
 
+  /**
+   * Transforms a set of descriptors into a bow vector and, optionally, a
+   * feature vector. The words of all the features are collected in a
+   * buffer and sorted by word (and by node) at once, and the vectors are
+   * written from it in a single pass. The buffers are kept by each thread,
+   * so no memory is allocated but for the output vectors
+   * @param features
+   * @param v (out) bow vector
+   * @param fv (out) if given, feature vector
+   * @param levelsup levels to go up the vocabulary tree to get the node index
+   * @param tracks if given, track id of each feature
+   *   (TransformCache::NO_TRACK if it is not tracked)
+   */
+  void transformFeatures(const std::vector<TDescriptor>& features,
+    BowVector &v, FeatureVector *fv, int levelsup,
+    const TrackId *tracks = NULL) const;
+
+  /**
+   * Finds the words of a set of features, as set by setSearch
+   * @param features
+   * @param items (out) words of the features in order: items[i] is the
+   *   word of features[i], or, with soft assignment, the words of each
+   *   feature are one after the other
+   * @param nids whether to get the ids of the nodes levelsup levels up
+   * @param levelsup levels to go up the vocabulary tree to get the node index
+   */
+  void findWords(const std::vector<TDescriptor>& features,
+    std::vector<FeatureWord> &items, bool nids, int levelsup) const;
+
+  /**
+   * Finds the words of a set of features in the cache, and those of the
+   * features that are not there with findWords, which are then added to
+   * the cache. There must be a cache and no soft assignment
+   * @param features
+   * @param tracks if given, track id of each feature
+   * @param items (out) items[i] is the word of features[i]
+   * @param nids whether to get the ids of the nodes levelsup levels up
+   * @param levelsup levels to go up the vocabulary tree to get the node index
+   */
+  void findCachedWords(const std::vector<TDescriptor>& features,
+    const TrackId *tracks, std::vector<FeatureWord> &items, bool nids,
+    int levelsup) const;
+
+  /**
+   * Returns the key of a descriptor in the cache
+   * @param feature
+   * @return key
+   */
+  static uint64_t cacheKey(const TDescriptor &feature);
+
+  /// Size of the descriptors of the compiled tree above which transform
+  /// uses descendTree. Smaller trees stay in the cache, and descending them
+  /// with one feature at a time is faster. The size is that of the packed
+  /// descriptors (F::size8U bytes each), so it is the same for any
+  /// TDescriptor with the same data
+  static const size_t BATCH_DESCENT_BYTES = (size_t)4 << 20;
+
+  /// Alignment of the descriptors of the compiled tree (a cache line)
+  static const size_t DESCRIPTOR_ALIGNMENT = 64;
+
+  /// Largest descriptor of the compiled tree, in bytes (e.g. 256 for 
+  /// SURF64). The descents keep the binary version of the feature in a 
+  /// buffer of this size on the stack, so they do not allocate memory. 
+  /// Trees with larger descriptors are not compiled
+  static const size_t MAX_DESCRIPTOR_BYTES = 256;
+
+  /**
+   * Writes the binary version of a feature, to compare it with the
+   * descriptors of the compiled tree
+   * @param feature
+   * @param p (out) buffer of m_descriptor_bytes bytes
+   */
+  inline void featureBytes(const TDescriptor &feature, unsigned char *p)
+    const
+  {
+    if((unsigned int)F::size8U(feature) != m_descriptor_bytes)
+      throw std::string("The features must have the size of the "
+        "descriptors of the vocabulary");
+    F::toArray8U(feature, p);
+  }
+
+  /**
+   * Returns the bytes of the descriptors of the compiled tree
+   * @return bytes
+   */
+  size_t treeDescriptorBytes() const;
+
+  /**
+   * Finds the words of a set of features in the compiled tree, which must
+   * exist. Instead of descending the tree with each feature, all the
+   * features go down one level at a time: the features that are at the
+   * same node are compared with each block of its children in turn, and
+   * then grouped by the child they choose. This way, each block of
+   * descriptors is read once per level for all the features that reach it,
+   * while it is in the cache, and the packed descriptors of the next
+   * groups are prefetched. The words are the same as those given by
+   * transform for each feature
+   * @param features
+   * @param items (out) word, weight and, if nids, node of each feature
+   *   (items[i] is the word of features[i])
+   * @param nids whether to get the ids of the nodes levelsup levels up
+   * @param levelsup levels to go up the vocabulary tree to get the node index
+   */
+  void descendTree(const std::vector<TDescriptor>& features,
+    std::vector<FeatureWord> &items, bool nids, int levelsup) const;
+
+  /**
+   * Finds the words of a feature in the compiled tree, which must exist,
+   * keeping the closest getSearchBeam() nodes of each level in a bounded
+   * priority queue
+   * @param feature binary version of the feature (see featureBytes)
+   * @param i_feature index of the feature
+   * @param words maximum number of words to get
+   * @param items (out) the words found are appended, the closest first,
+   *   with their weight shared as set by setSearch
+   * @param nids whether to get the ids of the nodes levelsup levels up
+   * @param levelsup levels to go up the vocabulary tree to get the node index
+   */
+  void searchTree(const unsigned char *feature, unsigned int i_feature,
+    unsigned int words, std::vector<FeatureWord> &items, bool nids,
+    int levelsup) const;
+
+  /**
+   * Orders the nodes found by a search by distance, and then by position
+   * @param a
+   * @param b
+   * @return true iff a is closer than b
+   */
+  static inline bool closerNode(const SearchNode &a, const SearchNode &b)
+  {
+    return a.distance < b.distance ||
+      (a.distance == b.distance && a.pos < b.pos);
+  }
+
+  /**
+   * Adds a node to a priority queue of the getSearchBeam() closest nodes.
+   * The queue is a sorted array: the beams are short, and most nodes are
+   * discarded by comparing them with the last one
+   * @param queue nodes sorted by closerNode
+   * @param node node to add, if it is closer than the last one when the
+   *   queue is full
+   */
+  inline void pushSearchNode(std::vector<SearchNode> &queue,
+    const SearchNode &node) const;
+
+
   /**
    * Creates an instance of the scoring object accoring to m_scoring
    */
   void createScoringObject();
 
+  /**
+   * Checks that the header of a binary file can be read
+   * @param header
+   * @param filename name of the file, for the error messages
+   */
+  static void checkBinaryHeader(const BinaryHeader &header,
+    const std::string &filename);
+
+  /**
+   * Checks that the references between the nodes of a compiled tree read
+   * from a file are valid
+   * @param nodes
+   * @param n number of nodes
+   * @param nwords number of words
+   * @return true iff the tree is valid
+   */
+  static bool checkFlatTree(const FlatNode *nodes, size_t n,
+    unsigned int nwords);
+
+  /**
+   * Removes the compiled tree, and the mapped file if any
+   */
+  void clearCompiled();
+
   /** 
    * Returns a set of pointers to descriptores
    * @param training_features all the features
@@ -347,31 +877,69 @@ protected:
   virtual void transform(const TDescriptor &feature, WordId &id) const;
       
   /**
-   * Creates a level in the tree, under the parent, by running kmeans with
-   * a descriptor set, and recursively creates the subsequent levels too
-   * @param parent_id id of parent node
+   * Creates a level in the tree by running kmeans with a descriptor set,
+   * and recursively creates the subsequent levels too. The subtrees of the
+   * children are created as parallel tasks in the pool
+   * @param node (out) subtree
    * @param descriptors descriptors to run the kmeans on
    * @param current_level current level in the tree
+   * @param seed seed of the random numbers of this subtree
+   * @param pool threads to use
+   */
+  void HKmeansStep(KMeansNode &node, const std::vector<pDescriptor> &descriptors,
+    int current_level, uint64_t seed, ThreadPool &pool) const;
+
+  /**
+   * Adds the nodes of a subtree created by HKmeansStep to the tree. The
+   * children of a node get consecutive ids, and then the subtree of each
+   * child is added in order
+   * @param parent_id id of the parent node in the tree
+   * @param node subtree
+   */
+  void addNodes(NodeId parent_id, const KMeansNode &node);
+
+  /**
+   * Returns the seed of the random numbers of a child subtree
+   * @param seed seed of the parent
+   * @param i index of the child
+   * @return seed of the child
    */
-  void HKmeansStep(NodeId parent_id, const std::vector<pDescriptor> &descriptors,
-    int current_level);
+  static uint64_t childSeed(uint64_t seed, unsigned int i);
 
   /**
    * Creates k clusters from the given descriptors with some seeding algorithm.
+   * The random numbers must be drawn from the given generator, which is
+   * seeded from the seed given with setSeed (or from a random one), so that
+   * a seeded vocabulary is reproducible.
    * @note In this class, kmeans++ is used, but this function should be
-   *   overriden by inherited classes.
+   *   overriden by inherited classes
+   * @param descriptors
+   * @param clusters resulting clusters
+   * @param rng random number generator of the node
+   */
+  virtual void initiateClusters(const std::vector<pDescriptor> &descriptors,
+    std::vector<TDescriptor> &clusters, RandomEngine &rng) const;
+
+  /**
+   * Former version of initiateClusters, without the generator. It is final
+   * so that the classes that still override it fail to compile, and must
+   * override the version with the generator instead. It seeds a generator
+   * with the seed given with setSeed (or 0) and calls that version
+   * @param descriptors
+   * @param clusters resulting clusters
    */
   virtual void initiateClusters(const std::vector<pDescriptor> &descriptors,
-    std::vector<TDescriptor> &clusters) const;
+    std::vector<TDescriptor> &clusters) const final;
   
   /**
    * Creates k clusters from the given descriptor sets by running the
    * initial step of kmeans++
    * @param descriptors 
    * @param clusters resulting clusters
+   * @param rng random number generator
    */
   void initiateClustersKMpp(const std::vector<pDescriptor> &descriptors,
-    std::vector<TDescriptor> &clusters) const;
+    std::vector<TDescriptor> &clusters, RandomEngine &rng) const;
   
   /**
    * Create the words of the vocabulary once the tree has been built
@@ -399,6 +967,33 @@ protected:
   
   /// Scoring method
   ScoringType m_scoring;
+
+  /// Number of threads used to create the vocabulary and transform batches
+  int m_threads;
+
+  /// Seed of the random numbers used to create the vocabulary
+  uint64_t m_seed;
+
+  /// Whether m_seed must be used, or a random seed instead
+  bool m_use_seed;
+
+  /// Nodes kept at each level by transform
+  unsigned int m_search_beam;
+
+  /// Words given to each feature by transform
+  unsigned int m_search_words;
+
+  /// Scale of the distances of soft assignment
+  double m_search_sigma;
+
+  /// Cache of the words of the features transformed (NULL if there is none)
+  std::unique_ptr<TransformCache> m_cache;
+
+  /// Pool of threads, created when it is needed (NULL until then)
+  mutable std::shared_ptr<ThreadPool> m_pool;
+
+  /// Protects the creation of m_pool
+  mutable std::mutex m_pool_mutex;
   
   /// Object for computing scores
   GeneralScoring* m_scoring_object;
@@ -409,6 +1004,33 @@ protected:
   /// Words of the vocabulary (tree leaves)
   /// this condition holds: m_words[wid]->word_id == wid
   std::vector<Node*> m_words;
+
+  /// Compiled tree in breadth-first order (m_flat_nodes[0] is the root).
+  /// Empty if the vocabulary has not been compiled
+  std::vector<FlatNode> m_flat_nodes;
+
+  /// Descriptors of the compiled tree in binary format (F::toArray8U), one
+  /// after the other in the order of m_flat_nodes and with zeros for the
+  /// root. They start at the first multiple of DESCRIPTOR_ALIGNMENT bytes
+  std::vector<unsigned char> m_flat_descriptors;
+
+  /// Compiled tree used by transform: m_flat_nodes, or the nodes of the
+  /// mapped file. NULL if the vocabulary has not been compiled
+  const FlatNode *m_tree_nodes;
+
+  /// Descriptors of m_tree_nodes in binary format: those of
+  /// m_flat_descriptors, or those of the mapped file
+  const unsigned char *m_tree_descriptors;
+
+  /// Number of nodes of m_tree_nodes
+  unsigned int m_tree_size;
+
+  /// Bytes of each descriptor of m_tree_descriptors
+  unsigned int m_descriptor_bytes;
+
+  /// Mapped file if the vocabulary is read-only. In that case, m_nodes
+  /// and m_words are empty
+  std::shared_ptr<const MappedTree> m_mapped;
   
 };
 
@@ -418,7 +1040,10 @@ template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
   (int k, int L, WeightingType weighting, ScoringType scoring)
   : m_k(k), m_L(L), m_weighting(weighting), m_scoring(scoring),
-  m_scoring_object(NULL)
+  m_threads(1), m_seed(0), m_use_seed(false), m_search_beam(1),
+  m_search_words(1), m_search_sigma(0), m_scoring_object(NULL),
+  m_tree_nodes(NULL), m_tree_descriptors(NULL), m_tree_size(0),
+  m_descriptor_bytes(0)
 {
   createScoringObject();
 }
@@ -427,7 +1052,11 @@ TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
 
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
-  (const std::string &filename): m_scoring_object(NULL)
+  (const std::string &filename): m_threads(1), m_seed(0), m_use_seed(false),
+  m_search_beam(1), m_search_words(1), m_search_sigma(0),
+  m_scoring_object(NULL),
+  m_tree_nodes(NULL), m_tree_descriptors(NULL), m_tree_size(0),
+  m_descriptor_bytes(0)
 {
   load(filename);
 }
@@ -436,7 +1065,11 @@ TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
 
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
-  (const char *filename): m_scoring_object(NULL)
+  (const char *filename): m_threads(1), m_seed(0), m_use_seed(false),
+  m_search_beam(1), m_search_words(1), m_search_sigma(0),
+  m_scoring_object(NULL),
+  m_tree_nodes(NULL), m_tree_descriptors(NULL), m_tree_size(0),
+  m_descriptor_bytes(0)
 {
   load(filename);
 }
@@ -497,10 +1130,63 @@ void TemplatedVocabulary<TDescriptor,F>::setWeightingType(WeightingType type)
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::setSearch(unsigned int beam,
+  unsigned int words, double sigma)
+{
+  if(words == 0 || beam < words)
+    throw std::string("The search must keep at least as many nodes as "
+      "words, and one word at least");
+  if(sigma < 0)
+    throw std::string("The sigma of the search cannot be negative");
+
+  m_search_beam = beam;
+  m_search_words = words;
+  m_search_sigma = sigma;
+
+  clearCache();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::setCache(size_t capacity,
+  unsigned int shards)
+{
+  m_cache.reset(capacity > 0 ? new TransformCache(capacity, shards) : NULL);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::clearCache()
+{
+  if(m_cache) m_cache->clear();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TransformCache::Stats TemplatedVocabulary<TDescriptor,F>::getCacheStats()
+  const
+{
+  if(m_cache) return m_cache->stats();
+
+  TransformCache::Stats stats;
+  stats.hits = 0;
+  stats.misses = 0;
+  return stats;
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary(
   const TemplatedVocabulary<TDescriptor, F> &voc)
-  : m_scoring_object(NULL)
+  : m_threads(1), m_seed(0), m_use_seed(false), m_search_beam(1),
+  m_search_words(1), m_search_sigma(0), m_scoring_object(NULL),
+  m_tree_nodes(NULL), m_tree_descriptors(NULL), m_tree_size(0),
+  m_descriptor_bytes(0)
 {
   *this = voc;
 }
@@ -520,18 +1206,45 @@ TemplatedVocabulary<TDescriptor, F>&
 TemplatedVocabulary<TDescriptor,F>::operator=
   (const TemplatedVocabulary<TDescriptor, F> &voc)
 {  
+  if(this == &voc) return *this;
+
   this->m_k = voc.m_k;
   this->m_L = voc.m_L;
   this->m_scoring = voc.m_scoring;
   this->m_weighting = voc.m_weighting;
+  setThreads(voc.m_threads);
+  this->m_seed = voc.m_seed;
+  this->m_use_seed = voc.m_use_seed;
+  this->m_search_beam = voc.m_search_beam;
+  this->m_search_words = voc.m_search_words;
+  this->m_search_sigma = voc.m_search_sigma;
+
+  // the cache is not shared, but a new one is created with the same size
+  this->m_cache.reset(voc.m_cache ?
+    new TransformCache(voc.m_cache->capacity(), voc.m_cache->shards()) :
+    NULL);
 
   this->createScoringObject();
   
   this->m_nodes.clear();
   this->m_words.clear();
+  this->clearCompiled();
   
-  this->m_nodes = voc.m_nodes;
-  this->createWords();
+  if(voc.isMapped())
+  {
+    // the mapping is shared
+    this->m_mapped = voc.m_mapped;
+    this->m_tree_nodes = voc.m_tree_nodes;
+    this->m_tree_descriptors = voc.m_tree_descriptors;
+    this->m_tree_size = voc.m_tree_size;
+    this->m_descriptor_bytes = voc.m_descriptor_bytes;
+  }
+  else
+  {
+    this->m_nodes = voc.m_nodes;
+    this->createWords();
+    this->compile();
+  }
   
   return *this;
 }
@@ -544,6 +1257,7 @@ void TemplatedVocabulary<TDescriptor,F>::create(
 {
   m_nodes.clear();
   m_words.clear();
+  clearCompiled();
   
   // expected_nodes = Sum_{i=0..L} ( k^i )
 	int expected_nodes = 
@@ -558,15 +1272,32 @@ void TemplatedVocabulary<TDescriptor,F>::create(
 
   // create root  
   m_nodes.push_back(Node(0)); // root
+
+  uint64_t seed = m_seed;
+  if(!m_use_seed)
+  {
+    DUtils::Random::SeedRandOnce();
+    seed = ((uint64_t)DUtils::Random::RandomInt(0, 0xffff) << 48) ^
+      ((uint64_t)DUtils::Random::RandomInt(0, 0xffffff) << 24) ^
+      (uint64_t)DUtils::Random::RandomInt(0, 0xffffff);
+  }
   
   // create the tree
-  HKmeansStep(0, features, 1);
+  {
+    KMeansNode root;
+    std::shared_ptr<ThreadPool> pool = getThreadPool();
+    HKmeansStep(root, features, 1, seed, *pool);
+    addNodes(0, root);
+  }
 
   // create the words
   createWords();
 
   // and set the weight of each node of the tree
   setNodeWeights(training_features);
+
+  // build the tree used by transform
+  compile();
   
 }
 
@@ -623,24 +1354,25 @@ void TemplatedVocabulary<TDescriptor,F>::getFeatures(
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedVocabulary<TDescriptor,F>::HKmeansStep(NodeId parent_id, 
-  const std::vector<pDescriptor> &descriptors, int current_level)
+void TemplatedVocabulary<TDescriptor,F>::HKmeansStep(KMeansNode &node, 
+  const std::vector<pDescriptor> &descriptors, int current_level,
+  uint64_t seed, ThreadPool &pool) const
 {
   if(descriptors.empty()) return;
+
+  // descriptors processed by each parallel task in a node
+  const size_t BLOCK = 1024;
+
+  RandomEngine rng(seed);
         
   // features associated to each cluster
-  std::vector<TDescriptor> clusters;
+  std::vector<TDescriptor> &clusters = node.clusters;
   std::vector<std::vector<unsigned int> > groups; // groups[i] = [j1, j2, ...]
 	// j1, j2, ... indices of descriptors associated to cluster i
 
   clusters.reserve(m_k);
 	groups.reserve(m_k);
   
-  //const int msizes[] = { m_k, descriptors.size() };
-  //cv::SparseMat assoc(2, msizes, CV_8U);
-  //cv::SparseMat last_assoc(2, msizes, CV_8U);  
-  //// assoc.row(cluster_idx).col(descriptor_idx) = 1 iif associated
-  
   if((int)descriptors.size() <= m_k)
   {
     // trivial case: one cluster per feature
@@ -669,72 +1401,79 @@ void TemplatedVocabulary<TDescriptor,F>::HKmeansStep(NodeId parent_id,
 			if(first_time)
 			{
         // random sample 
-        initiateClusters(descriptors, clusters);
+        initiateClusters(descriptors, clusters, rng);
       }
       else
       {
-        // calculate cluster centres
+        // calculate cluster centres (in parallel if there are many
+        // descriptors)
+
+        const size_t grain = 
+          (descriptors.size() >= BLOCK ? 1 : clusters.size());
 
-        for(unsigned int c = 0; c < clusters.size(); ++c)
+        pool.parallelFor(0, clusters.size(), [&](size_t c)
         {
+          // keep the previous centre if the cluster got empty
+          if(groups[c].empty()) return;
+
           std::vector<pDescriptor> cluster_descriptors;
           cluster_descriptors.reserve(groups[c].size());
           
-          /*
-          for(unsigned int d = 0; d < descriptors.size(); ++d)
-          {
-            if( assoc.find<unsigned char>(c, d) )
-            {
-              cluster_descriptors.push_back(descriptors[d]);
-            }
-          }
-          */
-          
           std::vector<unsigned int>::const_iterator vit;
           for(vit = groups[c].begin(); vit != groups[c].end(); ++vit)
           {
             cluster_descriptors.push_back(descriptors[*vit]);
           }
           
-          
           F::meanValue(cluster_descriptors, clusters[c]);
-        }
+        }, grain);
         
       } // if(!first_time)
 
       // 2. Associate features with clusters
 
-      // calculate distances to cluster centers
-      groups.clear();
-      groups.resize(clusters.size(), std::vector<unsigned int>());
+      // calculate distances to cluster centers, in parallel by blocks of
+      // descriptors
       current_association.resize(descriptors.size());
 
-      //assoc.clear();
-
-      typename std::vector<pDescriptor>::const_iterator fit;
-      //unsigned int d = 0;
-      for(fit = descriptors.begin(); fit != descriptors.end(); ++fit)//, ++d)
+      const size_t nblocks = (descriptors.size() + BLOCK - 1) / BLOCK;
+      pool.parallelFor(0, nblocks, [&](size_t b)
       {
-        double best_dist = F::distance(*(*fit), clusters[0]);
-        unsigned int icluster = 0;
-        
-        for(unsigned int c = 1; c < clusters.size(); ++c)
+        // distances from a descriptor to all the clusters
+        std::vector<double> dists(clusters.size());
+
+        const size_t end = std::min(descriptors.size(), (b + 1) * BLOCK);
+        for(size_t d = b * BLOCK; d < end; ++d)
         {
-          double dist = F::distance(*(*fit), clusters[c]);
-          if(dist < best_dist)
+          F::distances(*descriptors[d], &clusters[0], clusters.size(),
+            &dists[0]);
+          
+          double best_dist = dists[0];
+          unsigned int icluster = 0;
+          
+          for(unsigned int c = 1; c < clusters.size(); ++c)
           {
-            best_dist = dist;
-            icluster = c;
+            double dist = dists[c];
+            if(dist < best_dist)
+            {
+              best_dist = dist;
+              icluster = c;
+            }
           }
-        }
 
-        //assoc.ref<unsigned char>(icluster, d) = 1;
+          current_association[d] = icluster;
+        }
+      });
 
-        groups[icluster].push_back(fit - descriptors.begin());
-        current_association[ fit - descriptors.begin() ] = icluster;
+      groups.clear();
+      groups.resize(clusters.size(), std::vector<unsigned int>());
+      for(unsigned int d = 0; d < current_association.size(); ++d)
+      {
+        groups[current_association[d]].push_back(d);
       }
       
-      // kmeans++ ensures all the clusters has any feature associated with them
+      // kmeans++ ensures all the clusters has any feature associated with
+      // them in the first iteration, but a cluster may become empty later
 
       // 3. check convergence
       if(first_time)
@@ -743,8 +1482,6 @@ void TemplatedVocabulary<TDescriptor,F>::HKmeansStep(NodeId parent_id,
       }
       else
       {
-        //goon = !eqUChar(last_assoc, assoc);
-        
         goon = false;
         for(unsigned int i = 0; i < current_association.size(); i++)
         {
@@ -759,57 +1496,109 @@ void TemplatedVocabulary<TDescriptor,F>::HKmeansStep(NodeId parent_id,
 			{
 				// copy last feature-cluster association
 				last_association = current_association;
-				//last_assoc = assoc.clone();
 			}
 			
 		} // while(goon)
     
   } // if must run kmeans
   
-  // create nodes
-  for(unsigned int i = 0; i < clusters.size(); ++i)
-  {
-    NodeId id = m_nodes.size();
-    m_nodes.push_back(Node(id));
-    m_nodes.back().descriptor = clusters[i];
-    m_nodes.back().parent = parent_id;
-    m_nodes[parent_id].children.push_back(id);
-  }
-  
   // go on with the next level
   if(current_level < m_L)
   {
-    // iterate again with the resulting clusters
-    const std::vector<NodeId> &children_ids = m_nodes[parent_id].children;
+    // iterate again with the resulting clusters. Each subtree is a task
+    // with its own random numbers, so the result does not depend on the
+    // order the tasks run
+    node.children.resize(clusters.size());
+
+    std::vector<std::vector<pDescriptor> > child_features(clusters.size());
+    ThreadPool::TaskGroup group(pool);
+
     for(unsigned int i = 0; i < clusters.size(); ++i)
     {
-      NodeId id = children_ids[i];
-
-      std::vector<pDescriptor> child_features;
-      child_features.reserve(groups[i].size());
+      child_features[i].reserve(groups[i].size());
 
       std::vector<unsigned int>::const_iterator vit;
       for(vit = groups[i].begin(); vit != groups[i].end(); ++vit)
       {
-        child_features.push_back(descriptors[*vit]);
+        child_features[i].push_back(descriptors[*vit]);
       }
+      std::vector<unsigned int>().swap(groups[i]); // not needed any more
 
-      if(child_features.size() > 1)
+      if(child_features[i].size() > 1)
       {
-        HKmeansStep(id, child_features, current_level + 1);
+        KMeansNode *child = &node.children[i];
+        const std::vector<pDescriptor> *features = &child_features[i];
+        const uint64_t child_seed = childSeed(seed, i);
+
+        group.run([this, child, features, current_level, child_seed, &pool]()
+        {
+          HKmeansStep(*child, *features, current_level + 1, child_seed, pool);
+        });
       }
     }
+
+    group.wait();
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::addNodes(NodeId parent_id,
+  const KMeansNode &node)
+{
+  // create nodes
+  for(unsigned int i = 0; i < node.clusters.size(); ++i)
+  {
+    NodeId id = m_nodes.size();
+    m_nodes.push_back(Node(id));
+    m_nodes.back().descriptor = node.clusters[i];
+    m_nodes.back().parent = parent_id;
+    m_nodes[parent_id].children.push_back(id);
+  }
+
+  // and their subtrees
+  for(unsigned int i = 0; i < node.children.size(); ++i)
+  {
+    if(!node.children[i].clusters.empty())
+    {
+      addNodes(m_nodes[parent_id].children[i], node.children[i]);
+    }
   }
 }
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+uint64_t TemplatedVocabulary<TDescriptor,F>::childSeed(uint64_t seed,
+  unsigned int i)
+{
+  // splitmix64 finalizer
+  uint64_t z = seed + 0x9e3779b97f4a7c15ULL * ((uint64_t)i + 1);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor, F>::initiateClusters
+  (const std::vector<pDescriptor> &descriptors,
+   std::vector<TDescriptor> &clusters, RandomEngine &rng) const
+{
+  initiateClustersKMpp(descriptors, clusters, rng);
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor, F>::initiateClusters
   (const std::vector<pDescriptor> &descriptors,
    std::vector<TDescriptor> &clusters) const
 {
-  initiateClustersKMpp(descriptors, clusters);  
+  RandomEngine rng(m_seed);
+  initiateClusters(descriptors, clusters, rng);
 }
 
 // --------------------------------------------------------------------------
@@ -817,7 +1606,7 @@ void TemplatedVocabulary<TDescriptor, F>::initiateClusters
 template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::initiateClustersKMpp(
   const std::vector<pDescriptor> &pfeatures,
-    std::vector<TDescriptor> &clusters) const
+    std::vector<TDescriptor> &clusters, RandomEngine &rng) const
 {
   // Implements kmeans++ seeding algorithm
   // Algorithm:
@@ -830,15 +1619,14 @@ void TemplatedVocabulary<TDescriptor,F>::initiateClustersKMpp(
   // 5. Now that the initial centers have been chosen, proceed using standard k-means 
   //    clustering.
 
-  DUtils::Random::SeedRandOnce();
-
   clusters.resize(0);
   clusters.reserve(m_k);
   std::vector<double> min_dists(pfeatures.size(), std::numeric_limits<double>::max());
   
   // 1.
   
-  int ifeature = DUtils::Random::RandomInt(0, pfeatures.size()-1);
+  int ifeature = 
+    std::uniform_int_distribution<int>(0, pfeatures.size()-1)(rng);
   
   // create first cluster
   clusters.push_back(*pfeatures[ifeature]);
@@ -873,7 +1661,7 @@ void TemplatedVocabulary<TDescriptor,F>::initiateClustersKMpp(
       double cut_d;
       do
       {
-        cut_d = DUtils::Random::RandomValue<double>(0, dist_sum);
+        cut_d = std::uniform_real_distribution<double>(0, dist_sum)(rng);
       } while(cut_d == 0.0);
 
       double d_up_now = 0;
@@ -925,6 +1713,98 @@ void TemplatedVocabulary<TDescriptor,F>::createWords()
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::compile()
+{
+  if(isMapped()) return; // the mapped tree is compiled already
+
+  clearCompiled();
+  
+  if(m_nodes.empty()) return;
+  
+  m_flat_nodes.reserve(m_nodes.size());
+  
+  // ids of the nodes in breadth-first order: queue[i] is the node stored
+  // in m_flat_nodes[i]
+  std::vector<NodeId> queue;
+  queue.reserve(m_nodes.size());
+  queue.push_back(0); // root
+  
+  for(unsigned int i = 0; i < queue.size(); ++i)
+  {
+    const Node &node = m_nodes[queue[i]];
+    
+    FlatNode flat;
+    flat.first_child = queue.size();
+    flat.nchildren = node.children.size();
+    flat.node_id = node.id;
+    flat.word_id = node.word_id;
+    flat.weight = node.weight;
+    
+    m_flat_nodes.push_back(flat);
+    
+    // the children are enqueued together, so they are contiguous
+    queue.insert(queue.end(), node.children.begin(), node.children.end());
+  }
+
+  // the descriptors are packed in the same order, so the children of a
+  // node are read without following a pointer for each of them. The root
+  // has no descriptor, so the size is taken from its first child
+  const unsigned int bytes =
+    (queue.size() > 1 ? F::size8U(m_nodes[queue[1]].descriptor) : 0);
+  if(bytes > MAX_DESCRIPTOR_BYTES)
+  {
+    // transform uses m_nodes instead
+    m_flat_nodes.clear();
+    m_flat_descriptors.clear();
+    return;
+  }
+
+  m_flat_descriptors.assign(
+    queue.size() * bytes + DESCRIPTOR_ALIGNMENT - 1, 0);
+  unsigned char *descriptors = m_flat_descriptors.data();
+  descriptors += (DESCRIPTOR_ALIGNMENT - 
+    (uintptr_t)descriptors % DESCRIPTOR_ALIGNMENT) % DESCRIPTOR_ALIGNMENT;
+
+  for(size_t i = 1; i < queue.size(); ++i)
+  {
+    const TDescriptor &d = m_nodes[queue[i]].descriptor;
+    if((unsigned int)F::size8U(d) != bytes)
+    {
+      // transform uses m_nodes instead
+      m_flat_nodes.clear();
+      m_flat_descriptors.clear();
+      return;
+    }
+    F::toArray8U(d, descriptors + i * bytes);
+  }
+
+  m_tree_nodes = m_flat_nodes.data();
+  m_tree_descriptors = descriptors;
+  m_tree_size = m_flat_nodes.size();
+  m_descriptor_bytes = bytes;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::clearCompiled()
+{
+  m_flat_nodes.clear();
+  m_flat_descriptors.clear();
+
+  m_tree_nodes = NULL;
+  m_tree_descriptors = NULL;
+  m_tree_size = 0;
+  m_descriptor_bytes = 0;
+
+  m_mapped.reset();
+
+  clearCache();
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::setNodeWeights
   (const std::vector<std::vector<TDescriptor> > &training_features)
@@ -986,7 +1866,7 @@ void TemplatedVocabulary<TDescriptor,F>::setNodeWeights
 template<class TDescriptor, class F>
 inline unsigned int TemplatedVocabulary<TDescriptor,F>::size() const
 {
-  return m_words.size();
+  return (isMapped() ? m_mapped->nwords : m_words.size());
 }
 
 // --------------------------------------------------------------------------
@@ -994,7 +1874,7 @@ inline unsigned int TemplatedVocabulary<TDescriptor,F>::size() const
 template<class TDescriptor, class F>
 inline bool TemplatedVocabulary<TDescriptor,F>::empty() const
 {
-  return m_words.empty();
+  return (isMapped() ? m_mapped->nwords == 0 : m_words.empty());
 }
 
 // --------------------------------------------------------------------------
@@ -1003,6 +1883,17 @@ template<class TDescriptor, class F>
 float TemplatedVocabulary<TDescriptor,F>::getEffectiveLevels() const
 {
   long sum = 0;
+
+  if(isMapped())
+  {
+    for(unsigned int wid = 0; wid < m_mapped->nwords; ++wid)
+    {
+      uint32_t i = m_mapped->words[wid];
+      for(; i != 0; sum++) i = m_mapped->parents[i];
+    }
+    return (float)((double)sum / (double)m_mapped->nwords);
+  }
+
   typename std::vector<Node*>::const_iterator wit;
   for(wit = m_words.begin(); wit != m_words.end(); ++wit)
   {
@@ -1019,6 +1910,13 @@ float TemplatedVocabulary<TDescriptor,F>::getEffectiveLevels() const
 template<class TDescriptor, class F>
 TDescriptor TemplatedVocabulary<TDescriptor,F>::getWord(WordId wid) const
 {
+  if(isMapped())
+  {
+    TDescriptor d;
+    F::fromArray8U(d, m_tree_descriptors +
+      (size_t)m_mapped->words[wid] * m_descriptor_bytes, m_descriptor_bytes);
+    return d;
+  }
   return m_words[wid]->descriptor;
 }
 
@@ -1027,6 +1925,7 @@ TDescriptor TemplatedVocabulary<TDescriptor,F>::getWord(WordId wid) const
 template<class TDescriptor, class F>
 WordValue TemplatedVocabulary<TDescriptor, F>::getWordWeight(WordId wid) const
 {
+  if(isMapped()) return m_tree_nodes[m_mapped->words[wid]].weight;
   return m_words[wid]->weight;
 }
 
@@ -1041,6 +1940,20 @@ WordId TemplatedVocabulary<TDescriptor, F>::transform
     return 0;
   }
   
+  if(m_cache)
+  {
+    const uint64_t key = cacheKey(feature);
+
+    TransformCache::Value value;
+    if(m_cache->find(key, -1, value)) return value.word;
+
+    value.node = 0;
+    value.levelsup = 0;
+    transform(feature, value.word, value.weight, &value.node, 0);
+    m_cache->insert(key, value);
+    return value.word;
+  }
+
   WordId wid;
   transform(feature, wid);
   return wid;
@@ -1048,135 +1961,657 @@ WordId TemplatedVocabulary<TDescriptor, F>::transform
 
 // --------------------------------------------------------------------------
 
-template<class TDescriptor, class F>
-void TemplatedVocabulary<TDescriptor,F>::transform(
-  const std::vector<TDescriptor>& features, BowVector &v) const
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::transform(
+  const std::vector<TDescriptor>& features, BowVector &v) const
+{
+  transformFeatures(features, v, NULL, 0);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::transform(
+  const std::vector<TDescriptor>& features,
+  BowVector &v, FeatureVector &fv, int levelsup) const
+{
+  transformFeatures(features, v, &fv, levelsup);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::transform(
+  const std::vector<TDescriptor>& features,
+  const std::vector<TrackId> &tracks, BowVector &v) const
+{
+  if(tracks.size() != features.size())
+    throw std::string("There must be a track id for each feature");
+
+  transformFeatures(features, v, NULL, 0, tracks.data());
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::transform(
+  const std::vector<TDescriptor>& features,
+  const std::vector<TrackId> &tracks, BowVector &v, FeatureVector &fv,
+  int levelsup) const
+{
+  if(tracks.size() != features.size())
+    throw std::string("There must be a track id for each feature");
+
+  transformFeatures(features, v, &fv, levelsup, tracks.data());
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::transformFeatures(
+  const std::vector<TDescriptor>& features,
+  BowVector &v, FeatureVector *fv, int levelsup, const TrackId *tracks) const
+{
+  v.clear();
+  if(fv) fv->clear();
+  
+  if(empty()) // safe for subclasses
+  {
+    return;
+  }
+
+  // items in the order of the features, sorted by node, and aux buffer
+  static thread_local std::vector<FeatureWord> items, by_node, buffer;
+
+  // weight is the idf value if TF_IDF or IDF, or 1 if TF or BINARY (and
+  // a share of it if there is soft assignment)
+  if(m_cache && m_search_words == 1)
+    findCachedWords(features, tracks, items, fv != NULL, levelsup);
+  else
+    findWords(features, items, fv != NULL, levelsup);
+
+  // stopped words are removed
+  WordId max_word = 0;
+  NodeId max_node = 0;
+  size_t nitems = 0;
+  for(size_t i = 0; i < items.size(); ++i)
+  {
+    if(items[i].weight > 0)
+    {
+      items[nitems++] = items[i];
+      max_word = std::max(max_word, items[i].word);
+      max_node = std::max(max_node, items[i].node);
+    }
+  }
+  items.resize(nitems);
+
+  if(items.empty()) return;
+
+  // feature vector: the features of each node keep their order, and only
+  // the closest word of each feature is used
+  if(fv)
+  {
+    if(m_search_words > 1)
+    {
+      by_node.clear();
+      for(size_t i = 0; i < items.size(); ++i)
+        if(items[i].closest) by_node.push_back(items[i]);
+    }
+    else
+    {
+      by_node = items;
+    }
+    RadixSort::sort(by_node, buffer,
+      [](const FeatureWord &w){ return w.node; }, max_node);
+
+    size_t nnodes = 1;
+    for(size_t i = 1; i < by_node.size(); ++i)
+      if(by_node[i].node != by_node[i-1].node) ++nnodes;
+
+    // the nodes come in ascending order, so they are just appended
+    fv->reserve(nnodes, by_node.size());
+    for(size_t i = 0; i < by_node.size(); ++i)
+      fv->addFeature(by_node[i].node, by_node[i].feature);
+  }
+
+  // bow vector: the weights of a repeated word are added up if TF or
+  // TF_IDF, or taken once if IDF or BINARY. The norm is computed as the
+  // words are completed, in the same order as BowVector::normalize
+  RadixSort::sort(items, buffer,
+    [](const FeatureWord &w){ return w.word; }, max_word);
+
+  size_t nwords = 1;
+  for(size_t i = 1; i < items.size(); ++i)
+    if(items[i].word != items[i-1].word) ++nwords;
+
+  LNorm norm;
+  const bool must = m_scoring_object->mustNormalize(norm);
+  const bool accumulate = (m_weighting == TF || m_weighting == TF_IDF);
+
+  v.reserve(nwords);
+  double sum = 0.0;
+  for(size_t i = 0; i < items.size(); ++i)
+  {
+    if(i > 0 && items[i].word == items[i-1].word)
+    {
+      if(accumulate) v.back().second += items[i].weight;
+      continue;
+    }
+
+    if(!v.empty())
+    {
+      const WordValue w = v.back().second;
+      sum += (norm == L1 ? fabs(w) : w * w);
+    }
+    v.push_back(BowVector::value_type(items[i].word, items[i].weight));
+  }
+  const WordValue w = v.back().second;
+  sum += (norm == L1 ? fabs(w) : w * w);
+
+  if(must)
+  {
+    const double n = (norm == L1 ? sum : sqrt(sum));
+    if(n > 0.0)
+    {
+      for(BowVector::iterator vit = v.begin(); vit != v.end(); ++vit)
+        vit->second /= n;
+    }
+  }
+  else if(accumulate)
+  {
+    // unnecessary when normalizing
+    const double nd = v.size();
+    for(BowVector::iterator vit = v.begin(); vit != v.end(); ++vit) 
+      vit->second /= nd;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::findWords(
+  const std::vector<TDescriptor>& features, std::vector<FeatureWord> &items,
+  bool nids, int levelsup) const
+{
+  if(isCompiled() && m_search_beam > 1)
+  {
+    unsigned char query[MAX_DESCRIPTOR_BYTES];
+    assert(m_descriptor_bytes <= MAX_DESCRIPTOR_BYTES);
+
+    items.clear();
+    for(size_t i = 0; i < features.size(); ++i)
+    {
+      featureBytes(features[i], query);
+      searchTree(query, i, m_search_words, items, nids, levelsup);
+    }
+  }
+  else if(isCompiled() && treeDescriptorBytes() > BATCH_DESCENT_BYTES)
+  {
+    descendTree(features, items, nids, levelsup);
+  }
+  else
+  {
+    items.resize(features.size());
+    for(size_t i = 0; i < features.size(); ++i)
+    {
+      FeatureWord &item = items[i];
+      item.node = 0;
+      item.feature = i;
+      item.closest = true;
+      transform(features[i], item.word, item.weight,
+        (nids ? &item.node : NULL), levelsup);
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::findCachedWords(
+  const std::vector<TDescriptor>& features, const TrackId *tracks,
+  std::vector<FeatureWord> &items, bool nids, int levelsup) const
+{
+  // features that are not in the cache, their positions and their words
+  static thread_local std::vector<TDescriptor> missing;
+  static thread_local std::vector<unsigned int> positions;
+  static thread_local std::vector<uint64_t> keys;
+  static thread_local std::vector<FeatureWord> found;
+
+  const size_t n = features.size();
+  items.resize(n);
+  missing.clear();
+  positions.clear();
+  keys.clear();
+
+  for(size_t i = 0; i < n; ++i)
+  {
+    const uint64_t key = (tracks && tracks[i] != TransformCache::NO_TRACK ?
+      TransformCache::trackKey(tracks[i]) : cacheKey(features[i]));
+
+    FeatureWord &item = items[i];
+    item.feature = i;
+    item.closest = true;
+
+    TransformCache::Value value;
+    if(m_cache->find(key, (nids ? levelsup : -1), value))
+    {
+      item.word = value.word;
+      item.node = (nids ? value.node : 0);
+      item.weight = value.weight;
+    }
+    else
+    {
+      missing.push_back(features[i]);
+      positions.push_back(i);
+      keys.push_back(key);
+    }
+  }
+
+  if(missing.empty()) return;
+
+  // the nodes are always found, so that the words can be used later by
+  // the same levelsup with feature vectors
+  findWords(missing, found, true, levelsup);
+  missing.clear(); // the descriptors may share data with the caller's
+
+  for(size_t j = 0; j < found.size(); ++j)
+  {
+    FeatureWord &item = items[positions[j]];
+    item.word = found[j].word;
+    item.node = (nids ? found[j].node : 0);
+    item.weight = found[j].weight;
+
+    TransformCache::Value value;
+    value.word = found[j].word;
+    value.node = found[j].node;
+    value.weight = found[j].weight;
+    value.levelsup = levelsup;
+    m_cache->insert(keys[j], value);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+uint64_t TemplatedVocabulary<TDescriptor,F>::cacheKey(
+  const TDescriptor &feature)
+{
+  static thread_local std::vector<unsigned char> bytes;
+  bytes.resize(F::size8U(feature));
+  if(!bytes.empty()) F::toArray8U(feature, bytes.data());
+
+  return TransformCache::descriptorKey(bytes.data(), bytes.size());
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+size_t TemplatedVocabulary<TDescriptor,F>::treeDescriptorBytes() const
+{
+  return (size_t)m_tree_size * m_descriptor_bytes;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::descendTree(
+  const std::vector<TDescriptor>& features, std::vector<FeatureWord> &items,
+  bool nids, int levelsup) const
+{
+  const unsigned int n = features.size();
+  items.resize(n);
+  if(n == 0) return;
+
+  // level at which the node must be stored, if nids
+  const int nid_level = m_L - levelsup;
+
+  // features that have not reached a word yet, grouped by the position in
+  // the compiled tree of the node where they are (node[i] for features[i])
+  static thread_local std::vector<unsigned int> group, next_group, node;
+  // features of a group sorted by chosen child, and their choices
+  static thread_local std::vector<unsigned int> sorted, best, count;
+  static thread_local std::vector<double> best_d;
+  // binary versions of the features, one after the other
+  static thread_local std::vector<unsigned char> queries;
+
+  const size_t bytes = m_descriptor_bytes;
+  queries.resize(n * bytes);
+
+  group.resize(n);
+  node.assign(n, 0); // root
+  for(unsigned int i = 0; i < n; ++i)
+  {
+    group[i] = i;
+    featureBytes(features[i], queries.data() + i * bytes);
+    items[i].node = 0;
+    items[i].feature = i;
+    items[i].closest = true;
+  }
+
+  // distances to a block of children
+  const unsigned int BLOCK = 16;
+  double d[BLOCK];
+
+  // features ahead whose children are prefetched
+  const size_t PREFETCH = 8;
+
+  for(int level = 1; !group.empty(); ++level)
+  {
+    next_group.clear();
+
+    for(size_t g = 0; g < group.size(); )
+    {
+#if defined(__GNUC__) || defined(__clang__)
+      // in the lower levels, the children of each node are rarely in the
+      // cache, so those of the next groups are requested in advance
+      if(g + PREFETCH < group.size())
+      {
+        const FlatNode &ahead = m_tree_nodes[node[group[g + PREFETCH]]];
+        const char *p = (const char*)
+          (m_tree_descriptors + ahead.first_child * bytes);
+        const char *e = p + ahead.nchildren * bytes;
+        for(; p < e; p += 64) __builtin_prefetch(p);
+        __builtin_prefetch(m_tree_nodes + ahead.first_child);
+      }
+#endif
+
+      // features in group[g, end) are at the same node
+      const unsigned int pos = node[group[g]];
+      size_t end = g + 1;
+      while(end < group.size() && node[group[end]] == pos) ++end;
+      const unsigned int m = end - g;
+
+      // the children of the node and their descriptors are contiguous
+      const FlatNode &parent = m_tree_nodes[pos];
+      const unsigned char *children =
+        m_tree_descriptors + parent.first_child * bytes;
+
+      // the first child always sets best and best_d
+      best.resize(m);
+      best_d.resize(m);
+
+      for(unsigned int b = 0; b < parent.nchildren; b += BLOCK)
+      {
+        const unsigned int nb = std::min(BLOCK, parent.nchildren - b);
+
+        for(unsigned int j = 0; j < m; ++j)
+        {
+          F::distances8U(queries.data() + group[g + j] * bytes,
+            children + b * bytes, bytes, nb, d);
+
+          for(unsigned int i = 0; i < nb; ++i)
+          {
+            if(b + i == 0 || d[i] < best_d[j])
+            {
+              best_d[j] = d[i];
+              best[j] = b + i;
+            }
+          }
+        }
+      }
+
+      // group the features by child, keeping their order (in the lower
+      // levels, most groups have a single feature)
+      sorted.resize(m);
+      if(m == 1)
+      {
+        sorted[0] = 0;
+      }
+      else
+      {
+        count.assign(parent.nchildren + 1, 0);
+        for(unsigned int j = 0; j < m; ++j) ++count[best[j] + 1];
+        for(unsigned int c = 0; c < parent.nchildren; ++c)
+          count[c + 1] += count[c];
+
+        for(unsigned int j = 0; j < m; ++j) sorted[count[best[j]]++] = j;
+      }
+
+      for(unsigned int j = 0; j < m; ++j)
+      {
+        const unsigned int f = group[g + sorted[j]];
+        const unsigned int child = parent.first_child + best[sorted[j]];
+        const FlatNode &next = m_tree_nodes[child];
+
+        node[f] = child;
+        if(nids && level == nid_level) items[f].node = next.node_id;
+
+        if(next.nchildren == 0)
+        {
+          items[f].word = next.word_id;
+          items[f].weight = next.weight;
+        }
+        else
+        {
+          next_group.push_back(f);
+        }
+      }
+
+      g = end;
+    }
+
+    group.swap(next_group);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::searchTree(
+  const unsigned char *feature, unsigned int i_feature, unsigned int words,
+  std::vector<FeatureWord> &items, bool nids, int levelsup) const
+{
+  // level at which the node must be stored, if nids
+  const int nid_level = m_L - levelsup;
+
+  // nodes kept at the current level and at the next one. The words reached
+  // before the last level stay in the queue to compete with the others
+  static thread_local std::vector<SearchNode> beam, next;
+
+  SearchNode root;
+  root.distance = 0;
+  root.pos = 0;
+  root.nid = 0;
+
+  beam.assign(1, root);
+
+  // distances to a block of children
+  const unsigned int BLOCK = 16;
+  double d[BLOCK];
+
+  for(int level = 1; ; ++level)
+  {
+    bool expanded = false;
+    next.clear();
+
+    for(size_t c = 0; c < beam.size(); ++c)
+    {
+      const SearchNode &parent = beam[c];
+      const FlatNode &node = m_tree_nodes[parent.pos];
+
+      if(node.nchildren == 0)
+      {
+        pushSearchNode(next, parent);
+        continue;
+      }
+
+      expanded = true;
+
+      // the children of the node and their descriptors are contiguous
+      const size_t bytes = m_descriptor_bytes;
+      const unsigned char *children =
+        m_tree_descriptors + node.first_child * bytes;
+
+      for(unsigned int b = 0; b < node.nchildren; b += BLOCK)
+      {
+        const unsigned int nb = std::min(BLOCK, node.nchildren - b);
+        F::distances8U(feature, children + b * bytes, bytes, nb, d);
+
+        for(unsigned int i = 0; i < nb; ++i)
+        {
+          SearchNode child;
+          child.distance = d[i];
+          child.pos = node.first_child + b + i;
+          child.nid = (nids && level == nid_level ?
+            m_tree_nodes[child.pos].node_id : parent.nid);
+
+          pushSearchNode(next, child);
+        }
+      }
+    }
+
+    if(!expanded) break; // all the nodes are words
+    beam.swap(next);
+  }
+
+  // the closest words are first
+  if(words > beam.size()) words = beam.size();
+
+  // the weight is only shared if the words are accumulated
+  const bool share = words > 1 && (m_weighting == TF || m_weighting == TF_IDF);
+  const double d0 = beam[0].distance;
+  const double s2 = 2 * m_search_sigma * m_search_sigma;
+
+  // the weight is shared among the words that are not stopped (weight 0),
+  // which are dropped from the vectors
+  double total = 0;
+  if(share)
+  {
+    for(unsigned int j = 0; j < words; ++j)
+    {
+      if(m_tree_nodes[beam[j].pos].weight == 0) continue;
+      const double dj = beam[j].distance;
+      total += (s2 > 0 ? exp(-(dj * dj - d0 * d0) / s2) : 1.);
+    }
+  }
+
+  for(unsigned int j = 0; j < words; ++j)
+  {
+    const FlatNode &node = m_tree_nodes[beam[j].pos];
+
+    FeatureWord item;
+    item.word = node.word_id;
+    item.node = beam[j].nid;
+    item.feature = i_feature;
+    item.weight = node.weight;
+    item.closest = (j == 0);
+
+    if(share && total > 0)
+    {
+      const double dj = beam[j].distance;
+      item.weight *= (s2 > 0 ? exp(-(dj * dj - d0 * d0) / s2) : 1.) / total;
+    }
+
+    items.push_back(item);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline void TemplatedVocabulary<TDescriptor,F>::pushSearchNode(
+  std::vector<SearchNode> &queue, const SearchNode &node) const
+{
+  if(queue.size() == m_search_beam)
+  {
+    if(!closerNode(node, queue.back())) return;
+    queue.pop_back();
+  }
+
+  // the farther nodes are moved one place back
+  queue.push_back(node);
+  size_t i = queue.size() - 1;
+  for(; i > 0 && closerNode(node, queue[i-1]); --i) queue[i] = queue[i-1];
+  queue[i] = node;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::transformBatch(
+  const std::vector<std::vector<TDescriptor> > &features,
+  std::vector<BowVector> &v) const
+{
+  v.resize(features.size());
+  if(features.empty()) return;
+
+  transformBatch(&features[0], features.size(), &v[0]);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::transformBatch(
+  const std::vector<std::vector<TDescriptor> > &features,
+  std::vector<BowVector> &v, std::vector<FeatureVector> &fv,
+  int levelsup) const
 {
-  v.clear();
-  
-  if(empty())
-  {
-    return;
-  }
+  v.resize(features.size());
+  fv.resize(features.size());
+  if(features.empty()) return;
 
-  // normalize 
-  LNorm norm;
-  bool must = m_scoring_object->mustNormalize(norm);
+  transformBatch(&features[0], features.size(), &v[0], &fv[0], levelsup);
+}
+
+// --------------------------------------------------------------------------
 
-  typename std::vector<TDescriptor>::const_iterator fit;
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::transformBatch(
+  const std::vector<TDescriptor> *features, size_t n,
+  BowVector *v, FeatureVector *fv, int levelsup) const
+{
+  if(n == 0) return;
 
-  if(m_weighting == TF || m_weighting == TF_IDF)
+  // each image is written only by the task that converts it, so the
+  // results do not depend on the number of threads
+  std::shared_ptr<ThreadPool> pool = getThreadPool();
+
+  if(fv != NULL)
   {
-    for(fit = features.begin(); fit < features.end(); ++fit)
-    {
-      WordId id;
-      WordValue w; 
-      // w is the idf value if TF_IDF, 1 if TF
-      
-      transform(*fit, id, w);
-      
-      // not stopped
-      if(w > 0) v.addWeight(id, w);
-    }
-    
-    if(!v.empty() && !must)
+    pool->parallelFor(0, n, [&](size_t i)
     {
-      // unnecessary when normalizing
-      const double nd = v.size();
-      for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++) 
-        vit->second /= nd;
-    }
-    
+      transform(features[i], v[i], fv[i], levelsup);
+    });
   }
-  else // IDF || BINARY
+  else
   {
-    for(fit = features.begin(); fit < features.end(); ++fit)
+    pool->parallelFor(0, n, [&](size_t i)
     {
-      WordId id;
-      WordValue w;
-      // w is idf if IDF, or 1 if BINARY
-      
-      transform(*fit, id, w);
-      
-      // not stopped
-      if(w > 0) v.addIfNotExist(id, w);
-      
-    } // if add_features
-  } // if m_weighting == ...
-  
-  if(must) v.normalize(norm);
+      transform(features[i], v[i]);
+    });
+  }
 }
 
 // --------------------------------------------------------------------------
 
-template<class TDescriptor, class F> 
-void TemplatedVocabulary<TDescriptor,F>::transform(
-  const std::vector<TDescriptor>& features,
-  BowVector &v, FeatureVector &fv, int levelsup) const
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::setThreads(int threads)
 {
-  v.clear();
-  fv.clear();
-  
-  if(empty()) // safe for subclasses
-  {
-    return;
-  }
-  
-  // normalize 
-  LNorm norm;
-  bool must = m_scoring_object->mustNormalize(norm);
-  
-  typename std::vector<TDescriptor>::const_iterator fit;
-  
-  if(m_weighting == TF || m_weighting == TF_IDF)
-  {
-    unsigned int i_feature = 0;
-    for(fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
-    {
-      WordId id;
-      NodeId nid;
-      WordValue w; 
-      // w is the idf value if TF_IDF, 1 if TF
-      
-      transform(*fit, id, w, &nid, levelsup);
-      
-      if(w > 0) // not stopped
-      { 
-        v.addWeight(id, w);
-        fv.addFeature(nid, i_feature);
-      }
-    }
-    
-    if(!v.empty() && !must)
-    {
-      // unnecessary when normalizing
-      const double nd = v.size();
-      for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++) 
-        vit->second /= nd;
-    }
-  
-  }
-  else // IDF || BINARY
-  {
-    unsigned int i_feature = 0;
-    for(fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
-    {
-      WordId id;
-      NodeId nid;
-      WordValue w;
-      // w is idf if IDF, or 1 if BINARY
-      
-      transform(*fit, id, w, &nid, levelsup);
-      
-      if(w > 0) // not stopped
-      {
-        v.addIfNotExist(id, w);
-        fv.addFeature(nid, i_feature);
-      }
-    }
-  } // if m_weighting == ...
-  
-  if(must) v.normalize(norm);
+  std::lock_guard<std::mutex> lock(m_pool_mutex);
+  m_threads = threads;
+  m_pool.reset();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+std::shared_ptr<ThreadPool>
+TemplatedVocabulary<TDescriptor,F>::getThreadPool() const
+{
+  std::lock_guard<std::mutex> lock(m_pool_mutex);
+  if(!m_pool) m_pool = std::make_shared<ThreadPool>(m_threads);
+  return m_pool;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::setThreadPool
+  (const std::shared_ptr<ThreadPool> &pool)
+{
+  std::lock_guard<std::mutex> lock(m_pool_mutex);
+  m_pool = pool;
+  if(pool) m_threads = pool->size();
 }
 
 // --------------------------------------------------------------------------
@@ -1204,21 +2639,89 @@ template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature, 
   WordId &word_id, WordValue &weight, NodeId *nid, int levelsup) const
 { 
-  // propagate the feature down the tree
-  std::vector<NodeId> nodes;
-  typename std::vector<NodeId>::const_iterator nit;
-
   // level at which the node must be stored in nid, if given
   const int nid_level = m_L - levelsup;
   if(nid_level <= 0 && nid != NULL) *nid = 0; // root
 
-  NodeId final_id = 0; // root
   int current_level = 0;
 
+  if(m_tree_nodes != NULL)
+  {
+    // binary version of the feature, which is compared with the packed
+    // descriptors of the compiled tree
+    unsigned char query[MAX_DESCRIPTOR_BYTES];
+    const size_t bytes = m_descriptor_bytes;
+    assert(bytes <= MAX_DESCRIPTOR_BYTES);
+    featureBytes(feature, query);
+
+    if(m_search_beam > 1)
+    {
+      // closest word found with the beam, with all its weight
+      static thread_local std::vector<FeatureWord> found;
+      found.clear();
+      searchTree(query, 0, 1, found, nid != NULL, levelsup);
+
+      word_id = found[0].word;
+      weight = found[0].weight;
+      if(nid != NULL && nid_level > 0) *nid = found[0].node;
+      return;
+    }
+
+    // propagate the feature down the compiled tree
+    const FlatNode *node = m_tree_nodes; // root
+    
+    // distances to a block of children
+    const unsigned int BLOCK = 16;
+    double d[BLOCK];
+
+    do
+    {
+      ++current_level;
+      
+      // the children of node and their descriptors are contiguous
+      const unsigned int first = node->first_child;
+      const unsigned char *children = m_tree_descriptors + first * bytes;
+      
+      unsigned int best = 0;
+      double best_d = 0;
+
+      for(unsigned int b = 0; b < node->nchildren; b += BLOCK)
+      {
+        const unsigned int n = std::min(BLOCK, node->nchildren - b);
+        F::distances8U(query, children + b * bytes, bytes, n, d);
+        
+        for(unsigned int i = 0; i < n; ++i)
+        {
+          if(b + i == 0 || d[i] < best_d)
+          {
+            best_d = d[i];
+            best = b + i;
+          }
+        }
+      }
+      
+      node = m_tree_nodes + first + best;
+      
+      if(nid != NULL && current_level == nid_level)
+        *nid = node->node_id;
+      
+    } while(node->nchildren > 0);
+    
+    word_id = node->word_id;
+    weight = node->weight;
+    return;
+  }
+
+  // propagate the feature down the tree
+  typename std::vector<NodeId>::const_iterator nit;
+
+  NodeId final_id = 0; // root
+
   do
   {
     ++current_level;
-    nodes = m_nodes[final_id].children;
+    // (reference, the children must not be copied on each level)
+    const std::vector<NodeId> &nodes = m_nodes[final_id].children;
     final_id = nodes[0];
  
     double best_d = F::distance(feature, m_nodes[final_id].descriptor);
@@ -1250,6 +2753,17 @@ template<class TDescriptor, class F>
 NodeId TemplatedVocabulary<TDescriptor,F>::getParentNode
   (WordId wid, int levelsup) const
 {
+  if(isMapped())
+  {
+    uint32_t i = m_mapped->words[wid]; // position in the compiled tree
+    while(levelsup > 0 && i != 0) // i == 0 --> root
+    {
+      --levelsup;
+      i = m_mapped->parents[i];
+    }
+    return m_tree_nodes[i].node_id;
+  }
+
   NodeId ret = m_words[wid]->id; // node id
   while(levelsup > 0 && ret != 0) // ret == 0 --> root
   {
@@ -1266,6 +2780,54 @@ void TemplatedVocabulary<TDescriptor,F>::getWordsFromNode
   (NodeId nid, std::vector<WordId> &words) const
 {
   words.clear();
+
+  if(isMapped())
+  {
+    // the compiled tree is not indexed by node id, so the position of
+    // each node is indexed the first time
+    const MappedTree &tree = *m_mapped;
+    std::call_once(tree.positions_once, [this, &tree]()
+    {
+      tree.positions.assign(m_tree_size, (uint32_t)m_tree_size);
+      for(unsigned int i = 0; i < m_tree_size; ++i)
+      {
+        const NodeId id = m_tree_nodes[i].node_id;
+        if(id < m_tree_size) tree.positions[id] = i;
+      }
+    });
+
+    if(nid >= tree.positions.size()) return;
+    const unsigned int i = tree.positions[nid];
+    if(i == m_tree_size) return;
+
+    if(m_tree_nodes[i].nchildren == 0)
+    {
+      words.push_back(m_tree_nodes[i].word_id);
+      return;
+    }
+
+    words.reserve(m_k);
+
+    std::vector<unsigned int> parents;
+    parents.push_back(i);
+
+    while(!parents.empty())
+    {
+      const FlatNode &parent = m_tree_nodes[parents.back()];
+      parents.pop_back();
+
+      for(unsigned int c = 0; c < parent.nchildren; ++c)
+      {
+        const FlatNode &child = m_tree_nodes[parent.first_child + c];
+
+        if(child.nchildren == 0)
+          words.push_back(child.word_id);
+        else
+          parents.push_back(parent.first_child + c);
+      }
+    }
+    return;
+  }
   
   if(m_nodes[nid].isLeaf())
   {
@@ -1305,6 +2867,9 @@ void TemplatedVocabulary<TDescriptor,F>::getWordsFromNode
 template<class TDescriptor, class F>
 int TemplatedVocabulary<TDescriptor,F>::stopWords(double minWeight)
 {
+  if(isMapped())
+    throw std::string("The words of a mapped vocabulary cannot be stopped");
+
   int c = 0;
   typename std::vector<Node*>::iterator wit;
   for(wit = m_words.begin(); wit != m_words.end(); ++wit)
@@ -1315,6 +2880,18 @@ int TemplatedVocabulary<TDescriptor,F>::stopWords(double minWeight)
       (*wit)->weight = 0;
     }
   }
+  
+  if(c > 0 && isCompiled())
+  {
+    typename std::vector<FlatNode>::iterator fit;
+    for(fit = m_flat_nodes.begin(); fit != m_flat_nodes.end(); ++fit)
+    {
+      if(fit->nchildren == 0) fit->weight = m_words[fit->word_id]->weight;
+    }
+  }
+
+  if(c > 0) clearCache();
+  
   return c;
 }
 
@@ -1353,6 +2930,7 @@ bool TemplatedVocabulary<TDescriptor,F>::loadFromTextFile(const std::string &fil
 
     m_words.clear();
     m_nodes.clear();
+    clearCompiled();
 
     std::string s;
     std::getline(f,s);
@@ -1427,6 +3005,8 @@ bool TemplatedVocabulary<TDescriptor,F>::loadFromTextFile(const std::string &fil
         }
     }
 
+    compile();
+
     return true;
 
 }
@@ -1464,6 +3044,9 @@ void TemplatedVocabulary<TDescriptor,F>::save(cv::FileStorage &f,
   //
   // The root node (index 0) is not included in the node vector
   //
+
+  if(isMapped())
+    throw std::string("Mapped vocabularies can only be saved with saveBinary");
   
   f << name << "{";
   
@@ -1536,6 +3119,7 @@ void TemplatedVocabulary<TDescriptor,F>::load(const cv::FileStorage &fs,
 {
   m_words.clear();
   m_nodes.clear();
+  clearCompiled();
   
   cv::FileNode fvoc = fs[name];
   
@@ -1580,6 +3164,341 @@ void TemplatedVocabulary<TDescriptor,F>::load(const cv::FileStorage &fs,
     m_nodes[nid].word_id = wid;
     m_words[wid] = &m_nodes[nid];
   }
+  
+  compile();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+uint64_t TemplatedVocabulary<TDescriptor,F>::getChecksum() const
+{
+  if(!isCompiled() && !m_nodes.empty())
+    throw std::string("All the descriptors must have the same size");
+
+  uint64_t checksum = BinaryIO::checksum(m_tree_nodes,
+    m_tree_size * sizeof(FlatNode));
+  return BinaryIO::checksum(m_tree_descriptors,
+    (size_t)m_tree_size * m_descriptor_bytes, checksum);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::saveBinary(
+  const std::string &filename) const
+{
+  std::ofstream f(filename.c_str(), std::ios::out | std::ios::binary);
+  if(!f.is_open()) throw std::string("Could not open file ") + filename;
+
+  saveBinary(f);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::saveBinary(std::ostream &f) const
+{
+  // Binary format (version 2):
+  // header (BinaryHeader)
+  // nodes of the compiled tree (FlatNode[header.nodes])
+  // descriptors (unsigned char[header.nodes][header.descriptor_bytes])
+  // position of the parent of each node (uint32_t[header.nodes])
+  // position of each word (uint32_t[header.words])
+  //
+  // The nodes are in breadth-first order, so the children of a node are
+  // contiguous and in the same order as in m_nodes. Positions are indices
+  // in the array of nodes. Each array is followed by zeros up to a multiple
+  // of BinaryIO::ALIGNMENT bytes, so that it can be used in place by
+  // mapBinary. Version 1 had no padding and no positions
+
+  if(!isCompiled() && !m_nodes.empty())
+    throw std::string("All the descriptors must have the same size");
+
+  std::vector<uint32_t> parents(m_tree_size, 0);
+  std::vector<uint32_t> words(size(), 0);
+  for(unsigned int i = 0; i < m_tree_size; ++i)
+  {
+    const FlatNode &node = m_tree_nodes[i];
+    for(unsigned int c = 0; c < node.nchildren; ++c)
+      parents[node.first_child + c] = i;
+
+    if(node.nchildren == 0 && i > 0) words[node.word_id] = i;
+  }
+
+  const size_t nodes_bytes = m_tree_size * sizeof(FlatNode);
+  const size_t descriptors_bytes = (size_t)m_tree_size * m_descriptor_bytes;
+  const size_t parents_bytes = parents.size() * sizeof(uint32_t);
+  const size_t words_bytes = words.size() * sizeof(uint32_t);
+
+  BinaryHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "DBoW2VOC", sizeof(header.magic));
+  header.byte_order = BinaryIO::BYTE_ORDER_MARK;
+  header.version = 2;
+  header.k = m_k;
+  header.L = m_L;
+  header.scoring = m_scoring;
+  header.weighting = m_weighting;
+  header.descriptor_bytes = m_descriptor_bytes;
+  header.weight_bytes = sizeof(WordValue);
+  header.nodes = m_tree_size;
+  header.words = words.size();
+  header.checksum = BinaryIO::checksum(m_tree_descriptors, descriptors_bytes,
+    BinaryIO::checksum(m_tree_nodes, nodes_bytes));
+
+  BinaryIO::write(f, &header, sizeof(header));
+  BinaryIO::write(f, m_tree_nodes, nodes_bytes);
+  BinaryIO::writePadding(f, nodes_bytes);
+  BinaryIO::write(f, m_tree_descriptors, descriptors_bytes);
+  BinaryIO::writePadding(f, descriptors_bytes);
+  BinaryIO::write(f, parents.data(), parents_bytes);
+  BinaryIO::writePadding(f, parents_bytes);
+  BinaryIO::write(f, words.data(), words_bytes);
+  BinaryIO::writePadding(f, words_bytes);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::checkBinaryHeader(
+  const BinaryHeader &header, const std::string &filename)
+{
+  if(memcmp(header.magic, "DBoW2VOC", sizeof(header.magic)) != 0)
+    throw filename + " is not a binary vocabulary file";
+  if(header.byte_order != BinaryIO::BYTE_ORDER_MARK)
+    throw filename + " was saved with a different byte order";
+  if(header.version < 1 || header.version > 2)
+    throw std::string("Unsupported version of the file ") + filename;
+  if(header.weight_bytes != sizeof(WordValue))
+    throw filename + " was saved with a different WordValue type";
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::checkFlatTree(
+  const FlatNode *nodes, size_t n, unsigned int nwords)
+{
+  // the root is the first node, and it has children unless it is alone
+  if(n > 0 && (nodes[0].node_id != 0 || (n > 1 && nodes[0].nchildren == 0)))
+    return false;
+
+  for(size_t i = 0; i < n; ++i)
+  {
+    const FlatNode &node = nodes[i];
+    if(node.node_id >= n ||
+      (node.nchildren > 0 && (node.first_child <= i ||
+        node.first_child >= n || node.nchildren > n - node.first_child)) ||
+      (node.nchildren == 0 && i > 0 && node.word_id >= nwords))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::loadBinary(
+  const std::string &filename)
+{
+  std::ifstream f(filename.c_str(), std::ios::in | std::ios::binary);
+  if(!f.is_open()) throw std::string("Could not open file ") + filename;
+
+  loadBinary(f, filename);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::loadBinary(std::istream &f,
+  const std::string &filename)
+{
+  BinaryHeader header;
+  BinaryIO::read(f, &header, sizeof(header));
+  checkBinaryHeader(header, filename);
+
+  std::vector<FlatNode> nodes(header.nodes);
+  std::vector<unsigned char> descriptors(
+    (size_t)header.nodes * header.descriptor_bytes);
+
+  BinaryIO::read(f, nodes.data(), nodes.size() * sizeof(FlatNode));
+  if(header.version >= 2)
+    BinaryIO::skipPadding(f, nodes.size() * sizeof(FlatNode));
+  BinaryIO::read(f, descriptors.data(), descriptors.size());
+
+  if(header.version >= 2)
+  {
+    // the positions stored after the descriptors are not needed
+    const size_t parents_bytes = nodes.size() * sizeof(uint32_t);
+    const size_t words_bytes = (size_t)header.words * sizeof(uint32_t);
+
+    BinaryIO::skipPadding(f, descriptors.size());
+    BinaryIO::skip(f, parents_bytes + BinaryIO::padding(parents_bytes));
+    BinaryIO::skip(f, words_bytes + BinaryIO::padding(words_bytes));
+  }
+
+  uint64_t checksum = BinaryIO::checksum(descriptors.data(), 
+    descriptors.size(), BinaryIO::checksum(nodes.data(),
+      nodes.size() * sizeof(FlatNode)));
+  if(checksum != header.checksum)
+    throw std::string("Wrong checksum in file ") + filename;
+
+  // check the references before using them
+  if(!checkFlatTree(nodes.data(), nodes.size(), header.words))
+    throw std::string("Corrupted vocabulary in file ") + filename;
+
+  m_k = header.k;
+  m_L = header.L;
+  m_scoring = (ScoringType)header.scoring;
+  m_weighting = (WeightingType)header.weighting;
+  createScoringObject();
+
+  m_words.clear();
+  m_nodes.clear();
+  clearCompiled();
+
+  m_nodes.resize(nodes.size());
+  m_words.resize(header.words, NULL);
+
+  for(size_t i = 0; i < nodes.size(); ++i)
+  {
+    const FlatNode &flat = nodes[i];
+    Node &node = m_nodes[flat.node_id];
+
+    node.id = flat.node_id;
+    node.weight = flat.weight;
+    node.word_id = flat.word_id;
+
+    if(i > 0)
+    {
+      F::fromArray8U(node.descriptor, &descriptors[i * header.descriptor_bytes],
+        header.descriptor_bytes);
+    }
+
+    node.children.reserve(flat.nchildren);
+    for(unsigned int c = 0; c < flat.nchildren; ++c)
+    {
+      const NodeId child_id = nodes[flat.first_child + c].node_id;
+      node.children.push_back(child_id);
+      m_nodes[child_id].parent = node.id;
+    }
+
+    if(flat.nchildren == 0 && i > 0)
+    {
+      m_words[flat.word_id] = &node;
+    }
+  }
+
+  for(size_t i = 0; i < m_words.size(); ++i)
+  {
+    if(m_words[i] == NULL)
+    {
+      m_words.clear();
+      m_nodes.clear();
+      throw std::string("Corrupted vocabulary in file ") + filename;
+    }
+  }
+
+  compile();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::mapBinary(
+  const std::string &filename, bool verify_checksum)
+{
+  std::shared_ptr<MappedTree> tree(new MappedTree(filename));
+  const unsigned char *data = tree->file.data();
+  const size_t size = tree->file.size();
+
+  BinaryHeader header;
+  if(size < sizeof(header))
+    throw filename + " is not a binary vocabulary file";
+  memcpy(&header, data, sizeof(header));
+  checkBinaryHeader(header, filename);
+
+  if(header.version < 2)
+    throw filename + " must be saved again with saveBinary to be mapped";
+  if(header.descriptor_bytes > MAX_DESCRIPTOR_BYTES)
+    throw filename + " has descriptors too large to be mapped";
+
+  // position of each array in the file (see saveBinary)
+  const size_t n = header.nodes;
+  const size_t bytes = header.descriptor_bytes;
+  const size_t nodes_bytes = n * sizeof(FlatNode);
+  const size_t descriptors_bytes = n * bytes;
+  const size_t parents_bytes = n * sizeof(uint32_t);
+  const size_t words_bytes = (size_t)header.words * sizeof(uint32_t);
+
+  const size_t nodes_at = sizeof(header);
+  const size_t descriptors_at =
+    nodes_at + nodes_bytes + BinaryIO::padding(nodes_bytes);
+  const size_t parents_at = descriptors_at + descriptors_bytes +
+    BinaryIO::padding(descriptors_bytes);
+  const size_t words_at =
+    parents_at + parents_bytes + BinaryIO::padding(parents_bytes);
+
+  if(words_at + words_bytes > size)
+    throw std::string("Unexpected end of the file ") + filename;
+
+  const FlatNode *nodes = 
+    reinterpret_cast<const FlatNode*>(data + nodes_at);
+  const unsigned char *descriptors = data + descriptors_at;
+  const uint32_t *parents = 
+    reinterpret_cast<const uint32_t*>(data + parents_at);
+  const uint32_t *words = reinterpret_cast<const uint32_t*>(data + words_at);
+
+  if(verify_checksum)
+  {
+    uint64_t checksum = BinaryIO::checksum(descriptors, descriptors_bytes,
+      BinaryIO::checksum(nodes, nodes_bytes));
+    if(checksum != header.checksum)
+      throw std::string("Wrong checksum in file ") + filename;
+  }
+
+  // the references are always checked, since they are used without bound
+  // checks. Parents come before their children in breadth-first order
+  bool valid = checkFlatTree(nodes, n, header.words) && 
+    (n == 0 || parents[0] == 0);
+  for(size_t i = 1; valid && i < n; ++i)
+  {
+    const uint32_t p = parents[i];
+    valid = (p < i && nodes[p].first_child <= i &&
+      i < nodes[p].first_child + nodes[p].nchildren);
+  }
+  for(unsigned int wid = 0; valid && wid < header.words; ++wid)
+  {
+    const uint32_t i = words[wid];
+    valid = (i > 0 && i < n && nodes[i].nchildren == 0 && 
+      nodes[i].word_id == wid);
+  }
+  if(!valid) throw std::string("Corrupted vocabulary in file ") + filename;
+
+  // the descriptors are compared in place with F::distances8U, so no
+  // TDescriptor is built for the nodes
+  tree->parents = parents;
+  tree->words = words;
+  tree->nwords = header.words;
+
+  m_k = header.k;
+  m_L = header.L;
+  m_scoring = (ScoringType)header.scoring;
+  m_weighting = (WeightingType)header.weighting;
+  createScoringObject();
+
+  m_words.clear();
+  m_nodes.clear();
+  clearCompiled();
+
+  m_mapped = tree;
+  m_tree_nodes = (n > 0 ? nodes : NULL);
+  m_tree_descriptors = descriptors;
+  m_tree_size = n;
+  m_descriptor_bytes = bytes;
 }
 
 // --------------------------------------------------------------------------
@@ -0,0 +1,239 @@
+/**
+ * File: ThreadPool.h
+ * Description: pool of worker threads with work stealing
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_THREAD_POOL__
+#define __D_T_THREAD_POOL__
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+
+namespace DBoW2 {
+
+/// Pool of threads that run tasks in parallel
+/**
+ * Each worker thread keeps its own queue of tasks. Tasks created by a
+ * worker are pushed to its own queue and run in LIFO order, and idle
+ * workers steal the oldest tasks from the other queues. Threads waiting
+ * for a group of tasks run pending tasks meanwhile, so tasks can create
+ * and wait for other tasks recursively.
+ */
+class ThreadPool
+{
+public:
+
+  /// Task to run
+  typedef std::function<void()> Task;
+
+  /// Set of tasks that can be waited for
+  class TaskGroup
+  {
+  public:
+
+    /**
+     * Creates an empty group of tasks to run in the given pool
+     * @param pool
+     */
+    explicit TaskGroup(ThreadPool &pool);
+
+    /**
+     * Waits for the tasks of the group
+     */
+    ~TaskGroup();
+
+    /**
+     * Adds a task to the group. If the pool has no workers, the task is
+     * run immediately
+     * @param task
+     */
+    void run(const Task &task);
+
+    /**
+     * Waits until all the tasks of the group have finished, running
+     * pending tasks of the pool meanwhile. If any task threw an exception,
+     * the first one is thrown again here
+     */
+    void wait();
+
+  protected:
+
+    friend class ThreadPool;
+
+    /**
+     * Marks a task of this group as finished
+     * @param error exception thrown by the task, if any
+     */
+    void finish(const std::exception_ptr &error);
+
+  protected:
+
+    /// Pool the tasks run in
+    ThreadPool &m_pool;
+
+    /// Number of tasks not finished yet
+    std::atomic<int> m_pending;
+
+    /// First exception thrown by a task
+    std::exception_ptr m_error;
+
+    /// Protects m_error and signals the end of the tasks
+    std::mutex m_mutex;
+    std::condition_variable m_finished;
+  };
+
+public:
+
+  /**
+   * Creates a pool
+   * @param threads number of threads that run tasks, including the ones
+   *   that wait for them. 0 means the number of hardware threads. A pool
+   *   with 1 thread has no workers and runs the tasks sequentially
+   */
+  explicit ThreadPool(int threads = 0);
+
+  /**
+   * Waits for the running tasks and stops the workers
+   */
+  ~ThreadPool();
+
+  /**
+   * Returns the number of threads that run tasks
+   * @return number of workers + 1
+   */
+  inline int size() const { return (int)m_workers.size() + 1; }
+
+  /**
+   * Calls f(i) for every i in [begin, end), splitting the range in
+   * chunks that run in parallel, and waits for them
+   * @param begin
+   * @param end
+   * @param f function to call
+   * @param grain minimum number of indices per chunk
+   */
+  template<class Function>
+  void parallelFor(size_t begin, size_t end, const Function &f,
+    size_t grain = 1);
+
+  /**
+   * Returns the number of hardware threads
+   * @return number of threads (at least 1)
+   */
+  static int hardwareThreads();
+
+protected:
+
+  /// Task with the group it belongs to
+  struct Item
+  {
+    Task task;
+    TaskGroup *group;
+  };
+
+  /// Queue of tasks of a worker
+  struct Queue
+  {
+    std::deque<Item> items;
+    std::mutex mutex;
+  };
+
+  /**
+   * Adds a task to the queue of the current worker, or to the shared
+   * queue if called from outside the workers
+   * @param item
+   */
+  void push(const Item &item);
+
+  /**
+   * Takes a pending task: first from the queue of the current worker,
+   * then from the shared queue and then stealing from the other workers
+   * @param item (out) task
+   * @return true iff a task was found
+   */
+  bool pop(Item &item);
+
+  /**
+   * Runs a task and notifies its group
+   * @param item
+   */
+  static void execute(Item &item);
+
+  /**
+   * Main loop of the workers
+   * @param index index of the worker
+   */
+  void work(int index);
+
+  /**
+   * Returns the index of the current thread in m_queues if it is a worker
+   * of this pool, or -1
+   */
+  int currentWorker() const;
+
+protected:
+
+  /// Worker threads
+  std::vector<std::thread> m_workers;
+
+  /// Queues: one per worker, and a shared one at the end
+  std::vector<Queue*> m_queues;
+
+  /// Number of tasks pushed and not taken yet
+  std::atomic<int> m_queued;
+
+  /// Stop flag for the workers
+  bool m_stop;
+
+  /// Used by idle workers to sleep until there are tasks
+  std::mutex m_mutex;
+  std::condition_variable m_available;
+};
+
+// --------------------------------------------------------------------------
+
+template<class Function>
+void ThreadPool::parallelFor(size_t begin, size_t end, const Function &f,
+  size_t grain)
+{
+  if(begin >= end) return;
+
+  const size_t n = end - begin;
+  if(grain < 1) grain = 1;
+
+  // a few chunks per thread to balance the load
+  size_t chunk = n / (4 * (size_t)size()) + 1;
+  if(chunk < grain) chunk = grain;
+
+  if(size() == 1 || chunk >= n)
+  {
+    for(size_t i = begin; i < end; ++i) f(i);
+    return;
+  }
+
+  TaskGroup group(*this);
+  for(size_t b = begin; b < end; b += chunk)
+  {
+    const size_t e = std::min(end, b + chunk);
+    group.run([&f, b, e]()
+    {
+      for(size_t i = b; i < e; ++i) f(i);
+    });
+  }
+  group.wait();
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
+#endif
+
@@ -0,0 +1,198 @@
+/**
+ * File: TransformCache.h
+ * Description: cache of the words of features already transformed
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_TRANSFORM_CACHE__
+#define __D_T_TRANSFORM_CACHE__
+
+#include <cstddef>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+#include "BowVector.h"
+
+namespace DBoW2 {
+
+/// Id given by the caller to a feature tracked along several images
+typedef uint64_t TrackId;
+
+/// Bounded cache of the words of features, shared by several threads
+/**
+ * The features are identified by 64-bit keys: a hash of the bits of their
+ * descriptor, or their track id. The cache is split into shards, each one
+ * with its own lock, so that several threads can use it at the same time.
+ * Each shard is a set-associative table: a key can only be in the WAYS
+ * slots of its set, and when they are full it replaces the key used least
+ * recently. Different features with the same key (which is very unlikely
+ * with 64 bits) are taken as the same one
+ */
+class TransformCache
+{
+public:
+
+  /// Value of the track ids of the features that are not tracked
+  static const TrackId NO_TRACK = ~(TrackId)0;
+
+  /// Slots of each set
+  static const size_t WAYS = 4;
+
+  /// Word of a feature
+  struct Value
+  {
+    /// Word id
+    WordId word;
+    /// Id of the node levelsup levels up from the word
+    NodeId node;
+    /// Weight of the word
+    WordValue weight;
+    /// Levels up of node
+    int levelsup;
+  };
+
+  /// Number of lookups that found a word and that did not
+  struct Stats
+  {
+    uint64_t hits;
+    uint64_t misses;
+  };
+
+  /**
+   * Creates an empty cache
+   * @param capacity total number of slots (> 0). It is rounded up to a
+   *   multiple of WAYS in each shard
+   * @param shards number of parts with their own lock (> 0)
+   */
+  TransformCache(size_t capacity, unsigned int shards);
+
+  /**
+   * Looks for the word of a feature, and counts a hit or a miss
+   * @param key key of the feature
+   * @param levelsup levels up of the node needed, or -1 if any is valid
+   * @param value (out) word found, only set if it is found
+   * @return true iff the key is in the cache with the given levelsup
+   */
+  bool find(uint64_t key, int levelsup, Value &value);
+
+  /**
+   * Stores the word of a feature, replacing the least recently used key of
+   * its set if it is full
+   * @param key key of the feature
+   * @param value word of the feature
+   */
+  void insert(uint64_t key, const Value &value);
+
+  /**
+   * Removes all the words, but keeps the counters
+   */
+  void clear();
+
+  /**
+   * Returns the number of hits and misses since the cache was created
+   * @return counters
+   */
+  Stats stats() const;
+
+  /**
+   * Returns the total number of slots
+   * @return capacity
+   */
+  inline size_t capacity() const { return m_sets * WAYS * m_nshards; }
+
+  /**
+   * Returns the number of shards
+   * @return shards
+   */
+  inline unsigned int shards() const { return m_nshards; }
+
+  /**
+   * Returns the key of a descriptor
+   * @param data bits of the descriptor
+   * @param bytes size of data
+   * @return key
+   */
+  static uint64_t descriptorKey(const unsigned char *data, size_t bytes);
+
+  /**
+   * Returns the key of a tracked feature
+   * @param track track id
+   * @return key
+   */
+  static uint64_t trackKey(TrackId track);
+
+protected:
+
+  /// Slot of a table
+  struct Slot
+  {
+    /// Key stored
+    uint64_t key;
+    /// Word of the key
+    Value value;
+    /// Time of the last use of the slot (0 if it has no key)
+    uint64_t used;
+  };
+
+  /// Part of the cache with its own lock
+  struct Shard
+  {
+    /// Lock of the table and the counters
+    mutable std::mutex mutex;
+    /// Slots of the table
+    std::vector<Slot> slots;
+    /// Lookups that found a word
+    uint64_t hits;
+    /// Lookups that did not
+    uint64_t misses;
+    /// Number of uses of the slots, to order them
+    uint64_t clock;
+  };
+
+  /**
+   * Mixes the bits of a key, so that all of them change the shard and
+   * the slot
+   * @param key
+   * @return mixed key
+   */
+  static inline uint64_t mix(uint64_t key)
+  {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+  /**
+   * Returns the set of a key
+   * @param key
+   * @param shard (out) shard of the set
+   * @return first of the WAYS slots of the set
+   */
+  inline Slot* setOf(uint64_t key, Shard *&shard) const
+  {
+    const uint64_t h = mix(key);
+    shard = &m_shards[h % m_nshards];
+    return &shard->slots[((h / m_nshards) % m_sets) * WAYS];
+  }
+
+protected:
+
+  /// Shards (mutexes cannot be moved, so they are not in a std::vector)
+  std::unique_ptr<Shard[]> m_shards;
+
+  /// Number of shards
+  unsigned int m_nshards;
+
+  /// Sets of each shard
+  size_t m_sets;
+};
+
+} // namespace DBoW2
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ * File: BinaryIO.cpp
+ * Description: helper functions to read and write binary files
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+
+#include "BinaryIO.h"
+
+namespace DBoW2 {
+
+const uint32_t BinaryIO::BYTE_ORDER_MARK;
+const uint64_t BinaryIO::CHECKSUM_SEED;
+const size_t BinaryIO::ALIGNMENT;
+
+// --------------------------------------------------------------------------
+
+uint64_t BinaryIO::checksum(const void *data, size_t bytes, uint64_t seed)
+{
+  const uint64_t PRIME = 1099511628211ULL;
+  const unsigned char *p = static_cast<const unsigned char*>(data);
+
+  uint64_t hash = seed;
+  for(; bytes >= 8; bytes -= 8, p += 8)
+  {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v)); // unaligned
+    hash = (hash ^ v) * PRIME;
+  }
+
+  for(; bytes > 0; --bytes, ++p)
+  {
+    hash = (hash ^ *p) * PRIME;
+  }
+
+  return hash;
+}
+
+// --------------------------------------------------------------------------
+
+void BinaryIO::write(std::ostream &out, const void *data, size_t bytes)
+{
+  out.write(static_cast<const char*>(data), bytes);
+  if(!out) throw std::string("Could not write to the binary file");
+}
+
+// --------------------------------------------------------------------------
+
+void BinaryIO::read(std::istream &in, void *data, size_t bytes)
+{
+  in.read(static_cast<char*>(data), bytes);
+  if(!in || (size_t)in.gcount() != bytes)
+    throw std::string("Unexpected end of the binary file");
+}
+
+// --------------------------------------------------------------------------
+
+void BinaryIO::write(std::ostream &out, const void *data, size_t bytes,
+  uint64_t &checksum)
+{
+  write(out, data, bytes);
+  checksum = BinaryIO::checksum(data, bytes, checksum);
+}
+
+// --------------------------------------------------------------------------
+
+void BinaryIO::read(std::istream &in, void *data, size_t bytes,
+  uint64_t &checksum)
+{
+  read(in, data, bytes);
+  checksum = BinaryIO::checksum(data, bytes, checksum);
+}
+
+// --------------------------------------------------------------------------
+
+void BinaryIO::skip(std::istream &in, size_t bytes)
+{
+  in.ignore(bytes);
+  if(!in || (size_t)in.gcount() != bytes)
+    throw std::string("Unexpected end of the binary file");
+}
+
+// --------------------------------------------------------------------------
+
+void BinaryIO::encodeVarint(uint32_t v, std::vector<unsigned char> &buffer)
+{
+  while(v >= 0x80)
+  {
+    buffer.push_back((unsigned char)(v | 0x80));
+    v >>= 7;
+  }
+  buffer.push_back((unsigned char)v);
+}
+
+// --------------------------------------------------------------------------
+
+const unsigned char* BinaryIO::decodeVarint(const unsigned char *p,
+  const unsigned char *end, uint32_t &v)
+{
+  v = 0;
+  for(int shift = 0; shift < 35; shift += 7, ++p)
+  {
+    if(p == end) break;
+
+    v |= (uint32_t)(*p & 0x7f) << shift;
+    if((*p & 0x80) == 0) return p + 1;
+  }
+  throw std::string("Wrong integer in the binary file");
+}
+
+// --------------------------------------------------------------------------
+
+void BinaryIO::writeVarint(std::ostream &out, uint32_t v, uint64_t &checksum)
+{
+  unsigned char buffer[5];
+  size_t n = 0;
+  while(v >= 0x80)
+  {
+    buffer[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  buffer[n++] = (unsigned char)v;
+
+  write(out, buffer, n, checksum);
+}
+
+// --------------------------------------------------------------------------
+
+uint32_t BinaryIO::readVarint(std::istream &in, uint64_t &checksum)
+{
+  unsigned char buffer[5];
+  size_t n = 0;
+  do
+  {
+    if(n == sizeof(buffer))
+      throw std::string("Wrong integer in the binary file");
+    read(in, &buffer[n], 1, checksum);
+  } while(buffer[n++] & 0x80);
+
+  uint32_t v;
+  decodeVarint(buffer, buffer + n, v);
+  return v;
+}
+
+// --------------------------------------------------------------------------
+
+void BinaryIO::writePadding(std::ostream &out, size_t bytes)
+{
+  const char zeros[ALIGNMENT] = {0};
+  write(out, zeros, padding(bytes));
+}
+
+// --------------------------------------------------------------------------
+
+void BinaryIO::skipPadding(std::istream &in, size_t bytes)
+{
+  skip(in, padding(bytes));
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
@@ -35,7 +35,7 @@ void BowVector::addWeight(WordId id, WordValue v)
 {
   BowVector::iterator vit = this->lower_bound(id);
   
-  if(vit != this->end() && !(this->key_comp()(id, vit->first)))
+  if(vit != this->end() && vit->first == id)
   {
     vit->second += v;
   }
@@ -51,7 +51,7 @@ void BowVector::addIfNotExist(WordId id, WordValue v)
 {
   BowVector::iterator vit = this->lower_bound(id);
   
-  if(vit == this->end() || (this->key_comp()(id, vit->first)))
+  if(vit == this->end() || vit->first != id)
   {
     this->insert(vit, BowVector::value_type(id, v));
   }
@@ -59,6 +59,67 @@ void BowVector::addIfNotExist(WordId id, WordValue v)
 
 // --------------------------------------------------------------------------
 
+/// Orders the words by id
+static inline bool lessWordId(const BowVector::value_type &a,
+  const BowVector::value_type &b)
+{
+  return a.first < b.first;
+}
+
+// --------------------------------------------------------------------------
+
+void BowVector::sortAndMerge(bool accumulate)
+{
+  if(this->empty()) return;
+
+  // the sort is stable so that the first value of each word comes first
+  std::stable_sort(this->begin(), this->end(), lessWordId);
+
+  BowVector::iterator last = this->begin();
+  for(BowVector::iterator vit = last + 1; vit != this->end(); ++vit)
+  {
+    if(vit->first != last->first)
+      *(++last) = *vit;
+    else if(accumulate)
+      last->second += vit->second;
+  }
+  this->erase(last + 1, this->end());
+}
+
+// --------------------------------------------------------------------------
+
+BowVector::iterator BowVector::lower_bound(WordId id)
+{
+  return std::lower_bound(this->begin(), this->end(),
+    BowVector::value_type(id, 0), lessWordId);
+}
+
+// --------------------------------------------------------------------------
+
+BowVector::const_iterator BowVector::lower_bound(WordId id) const
+{
+  return std::lower_bound(this->begin(), this->end(),
+    BowVector::value_type(id, 0), lessWordId);
+}
+
+// --------------------------------------------------------------------------
+
+BowVector::iterator BowVector::find(WordId id)
+{
+  BowVector::iterator vit = this->lower_bound(id);
+  return (vit != this->end() && vit->first == id ? vit : this->end());
+}
+
+// --------------------------------------------------------------------------
+
+BowVector::const_iterator BowVector::find(WordId id) const
+{
+  BowVector::const_iterator vit = this->lower_bound(id);
+  return (vit != this->end() && vit->first == id ? vit : this->end());
+}
+
+// --------------------------------------------------------------------------
+
 void BowVector::normalize(LNorm norm_type)
 {
   double norm = 0.0; 
@@ -0,0 +1,225 @@
+/**
+ * File: FBinary256.cpp
+ * Description: functions for 256-bit binary descriptors (e.g. ORB) stored
+ *   inline as four 64-bit words
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+
+#include "FBinary256.h"
+#include "Hamming.h"
+
+using namespace std;
+
+namespace DBoW2 {
+
+// --------------------------------------------------------------------------
+
+void FBinary256::meanValue(
+  const std::vector<FBinary256::pDescriptor> &descriptors,
+  FBinary256::TDescriptor &mean)
+{
+  mean.fill(0);
+
+  if(descriptors.empty())
+  {
+    return;
+  }
+  else if(descriptors.size() == 1)
+  {
+    mean = *descriptors[0];
+    return;
+  }
+
+  // The bits are counted in parallel: acc[w][j] keeps, in each of its 8
+  // bytes, the number of descriptors with the bit j of that byte of the
+  // word w set. The byte counters are moved to sum before they overflow
+  const uint64_t LSB = 0x0101010101010101ULL;
+
+  uint64_t acc[4][8];
+  int sum[256]; // sum[w*64 + i] = descriptors with the bit i of word w set
+  memset(acc, 0, sizeof(acc));
+  memset(sum, 0, sizeof(sum));
+
+  size_t pending = 0;
+  for(size_t i = 0; i < descriptors.size(); ++i)
+  {
+    const FBinary256::TDescriptor &d = *descriptors[i];
+
+    for(int w = 0; w < 4; ++w)
+    {
+      const uint64_t v = d[w];
+      for(int j = 0; j < 8; ++j) acc[w][j] += (v >> j) & LSB;
+    }
+
+    if(++pending == 255 || i + 1 == descriptors.size())
+    {
+      for(int w = 0; w < 4; ++w)
+      {
+        for(int j = 0; j < 8; ++j)
+        {
+          for(int b = 0; b < 8; ++b)
+            sum[w*64 + b*8 + j] += (int)((acc[w][j] >> (b*8)) & 0xff);
+          acc[w][j] = 0;
+        }
+      }
+      pending = 0;
+    }
+  }
+
+  // same rounding as FORB
+  const int N2 = (int)descriptors.size() / 2 + descriptors.size() % 2;
+  for(int w = 0; w < 4; ++w)
+  {
+    for(int i = 0; i < 64; ++i)
+    {
+      if(sum[w*64 + i] >= N2) mean[w] |= (uint64_t)1 << i;
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+double FBinary256::distance(const FBinary256::TDescriptor &a,
+  const FBinary256::TDescriptor &b)
+{
+  return Hamming::distance256(
+    reinterpret_cast<const unsigned char*>(a.data()),
+    reinterpret_cast<const unsigned char*>(b.data()));
+}
+
+// --------------------------------------------------------------------------
+
+void FBinary256::distances(const FBinary256::TDescriptor &a,
+  const FBinary256::TDescriptor *b, int n, double *d)
+{
+  // the descriptors are given to the kernel in blocks
+  const int BLOCK = 16;
+  const unsigned char *pb[BLOCK];
+  int db[BLOCK];
+
+  const unsigned char *pa = reinterpret_cast<const unsigned char*>(a.data());
+
+  for(int i = 0; i < n; i += BLOCK)
+  {
+    const int m = std::min(BLOCK, n - i);
+    for(int j = 0; j < m; ++j)
+      pb[j] = reinterpret_cast<const unsigned char*>(b[i + j].data());
+
+    Hamming::distances256(pa, pb, m, db);
+
+    for(int j = 0; j < m; ++j) d[i + j] = db[j];
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void FBinary256::distances8U(const unsigned char *a, const unsigned char *b,
+  int bytes, int n, double *d)
+{
+  // the distances are computed in blocks
+  const int BLOCK = 16;
+  int db[BLOCK];
+
+  for(int i = 0; i < n; i += BLOCK)
+  {
+    const int m = std::min(BLOCK, n - i);
+    Hamming::distances8U(a, b + (size_t)i * bytes, bytes, m, db);
+
+    for(int j = 0; j < m; ++j) d[i + j] = db[j];
+  }
+}
+
+// --------------------------------------------------------------------------
+
+std::string FBinary256::toString(const FBinary256::TDescriptor &a)
+{
+  stringstream ss;
+  const unsigned char *p = reinterpret_cast<const unsigned char*>(a.data());
+
+  for(int i = 0; i < FBinary256::L; ++i, ++p)
+  {
+    ss << (int)*p << " ";
+  }
+
+  return ss.str();
+}
+
+// --------------------------------------------------------------------------
+
+void FBinary256::fromString(FBinary256::TDescriptor &a, const std::string &s)
+{
+  a.fill(0);
+  unsigned char *p = reinterpret_cast<unsigned char*>(a.data());
+
+  stringstream ss(s);
+  for(int i = 0; i < FBinary256::L; ++i, ++p)
+  {
+    int n;
+    ss >> n;
+
+    if(!ss.fail())
+      *p = (unsigned char)n;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+int FBinary256::size8U(const FBinary256::TDescriptor &)
+{
+  return FBinary256::L;
+}
+
+// --------------------------------------------------------------------------
+
+void FBinary256::toArray8U(const FBinary256::TDescriptor &a, unsigned char *p)
+{
+  memcpy(p, a.data(), FBinary256::L);
+}
+
+// --------------------------------------------------------------------------
+
+void FBinary256::fromArray8U(FBinary256::TDescriptor &a,
+  const unsigned char *p, int bytes)
+{
+  a.fill(0);
+  memcpy(a.data(), p, bytes < FBinary256::L ? bytes : FBinary256::L);
+}
+
+// --------------------------------------------------------------------------
+
+void FBinary256::fromMat8U(const cv::Mat &mat,
+  std::vector<FBinary256::TDescriptor> &descriptors)
+{
+  descriptors.resize(mat.rows);
+
+  for(int i = 0; i < mat.rows; ++i)
+  {
+    memcpy(descriptors[i].data(), mat.ptr<unsigned char>(i), FBinary256::L);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void FBinary256::toMat8U(const std::vector<FBinary256::TDescriptor> &descriptors,
+  cv::Mat &mat)
+{
+  mat.create(descriptors.size(), FBinary256::L, CV_8U);
+
+  for(size_t i = 0; i < descriptors.size(); ++i)
+  {
+    memcpy(mat.ptr<unsigned char>(i), descriptors[i].data(), FBinary256::L);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
@@ -1,10 +1,13 @@
 #include <vector>
 #include <string>
+#include <cstring>
 #include <sstream>
+#include <algorithm>
 
 #include <DVision/DVision.h>
 
 #include "FBinaryDescriptor.h"
+#include "Hamming.h"
 
 using namespace std;
 
@@ -49,6 +52,32 @@ double FBinaryDescriptor::distance(const FBinaryDescriptor::TDescriptor &a,
   return (double)DVision::BRIEF::distance(a, b);
 }
 
+// --------------------------------------------------------------------------
+
+void FBinaryDescriptor::distances(const FBinaryDescriptor::TDescriptor &a, const FBinaryDescriptor::TDescriptor *b,
+  int n, double *d)
+{
+  for(int i = 0; i < n; ++i) d[i] = distance(a, b[i]);
+}
+
+// --------------------------------------------------------------------------
+
+void FBinaryDescriptor::distances8U(const unsigned char *a, const unsigned char *b,
+  int bytes, int n, double *d)
+{
+  // the distances are computed in blocks
+  const int BLOCK = 16;
+  int db[BLOCK];
+
+  for(int i = 0; i < n; i += BLOCK)
+  {
+    const int m = std::min(BLOCK, n - i);
+    Hamming::distances8U(a, b + (size_t)i * bytes, bytes, m, db);
+
+    for(int j = 0; j < m; ++j) d[i + j] = db[j];
+  }
+}
+
 // --------------------------------------------------------------------------
   
 std::string FBinaryDescriptor::toString(const FBinaryDescriptor::TDescriptor &a)
@@ -69,6 +98,38 @@ void FBinaryDescriptor::fromString(FBinaryDescriptor::TDescriptor &a, const std:
 }
 
 
+// --------------------------------------------------------------------------
+
+int FBinaryDescriptor::size8U(const FBinaryDescriptor::TDescriptor &a)
+{
+  return (int)((a.size() + 7) / 8);
+}
+
+// --------------------------------------------------------------------------
+
+void FBinaryDescriptor::toArray8U(const FBinaryDescriptor::TDescriptor &a, unsigned char *p)
+{
+  // bit i is stored in the bit i % 8 of byte i / 8
+  memset(p, 0, size8U(a));
+  for(size_t i = 0; i < a.size(); ++i)
+  {
+    if(a[i]) p[i / 8] |= (unsigned char)(1 << (i % 8));
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void FBinaryDescriptor::fromArray8U(FBinaryDescriptor::TDescriptor &a, const unsigned char *p,
+  int bytes)
+{
+  a.resize(bytes * 8);
+  a.reset();
+  for(size_t i = 0; i < a.size(); ++i)
+  {
+    if(p[i / 8] & (1 << (i % 8))) a.set(i);
+  }
+}
+
 // --------------------------------------------------------------------------
 
 } // namespace DBoW2
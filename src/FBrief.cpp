@@ -9,10 +9,13 @@
  
 #include <vector>
 #include <string>
+#include <cstring>
 #include <sstream>
+#include <algorithm>
 
 #include <DVision/DVision.h>
 #include "FBrief.h"
+#include "Hamming.h"
 
 using namespace std;
 
@@ -57,6 +60,32 @@ double FBrief::distance(const FBrief::TDescriptor &a,
   return (double)DVision::BRIEF::distance(a, b);
 }
 
+// --------------------------------------------------------------------------
+
+void FBrief::distances(const FBrief::TDescriptor &a, const FBrief::TDescriptor *b,
+  int n, double *d)
+{
+  for(int i = 0; i < n; ++i) d[i] = distance(a, b[i]);
+}
+
+// --------------------------------------------------------------------------
+
+void FBrief::distances8U(const unsigned char *a, const unsigned char *b,
+  int bytes, int n, double *d)
+{
+  // the distances are computed in blocks
+  const int BLOCK = 16;
+  int db[BLOCK];
+
+  for(int i = 0; i < n; i += BLOCK)
+  {
+    const int m = std::min(BLOCK, n - i);
+    Hamming::distances8U(a, b + (size_t)i * bytes, bytes, m, db);
+
+    for(int j = 0; j < m; ++j) d[i + j] = db[j];
+  }
+}
+
 // --------------------------------------------------------------------------
   
 std::string FBrief::toString(const FBrief::TDescriptor &a)
@@ -78,5 +107,37 @@ void FBrief::fromString(FBrief::TDescriptor &a, const std::string &s)
 
 // --------------------------------------------------------------------------
 
+int FBrief::size8U(const FBrief::TDescriptor &a)
+{
+  return (int)((a.size() + 7) / 8);
+}
+
+// --------------------------------------------------------------------------
+
+void FBrief::toArray8U(const FBrief::TDescriptor &a, unsigned char *p)
+{
+  // bit i is stored in the bit i % 8 of byte i / 8
+  memset(p, 0, size8U(a));
+  for(size_t i = 0; i < a.size(); ++i)
+  {
+    if(a[i]) p[i / 8] |= (unsigned char)(1 << (i % 8));
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void FBrief::fromArray8U(FBrief::TDescriptor &a, const unsigned char *p,
+  int bytes)
+{
+  a.resize(bytes * 8);
+  a.reset();
+  for(size_t i = 0; i < a.size(); ++i)
+  {
+    if(p[i / 8] & (1 << (i % 8))) a.set(i);
+  }
+}
+
+// --------------------------------------------------------------------------
+
 } // namespace DBoW2
 
@@ -9,13 +9,16 @@
  
 #include <vector>
 #include <string>
+#include <cstring>
 #include <sstream>
 #include <stdint.h>
 #include <limits.h>
+#include <algorithm>
 
 #include <DUtils/DUtils.h>
 #include <DVision/DVision.h>
 #include "FORB.h"
+#include "Hamming.h"
 
 using namespace std;
 
@@ -79,6 +82,12 @@ void FORB::meanValue(const std::vector<FORB::pDescriptor> &descriptors,
 double FORB::distance(const FORB::TDescriptor &a, 
   const FORB::TDescriptor &b)
 {
+  if(a.cols == FORB::L)
+  {
+    // a & b are actually CV_8U
+    return Hamming::distance256(a.data, b.data);
+  }
+  
   // Bit count function got from:
   // http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetKernighan
   // This implementation assumes that a.cols (CV_8U) % sizeof(uint64_t) == 0
@@ -116,6 +125,51 @@ double FORB::distance(const FORB::TDescriptor &a,
   // return ret;
 }
 
+// --------------------------------------------------------------------------
+
+void FORB::distances(const FORB::TDescriptor &a, const FORB::TDescriptor *b,
+  int n, double *d)
+{
+  if(a.cols != FORB::L)
+  {
+    for(int i = 0; i < n; ++i) d[i] = distance(a, b[i]);
+    return;
+  }
+  
+  // the descriptors are given to the kernel in blocks
+  const int BLOCK = 16;
+  const unsigned char *pb[BLOCK];
+  int db[BLOCK];
+  
+  for(int i = 0; i < n; i += BLOCK)
+  {
+    const int m = std::min(BLOCK, n - i);
+    for(int j = 0; j < m; ++j) pb[j] = b[i + j].data;
+    
+    Hamming::distances256(a.data, pb, m, db);
+    
+    for(int j = 0; j < m; ++j) d[i + j] = db[j];
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void FORB::distances8U(const unsigned char *a, const unsigned char *b,
+  int bytes, int n, double *d)
+{
+  // the distances are computed in blocks
+  const int BLOCK = 16;
+  int db[BLOCK];
+
+  for(int i = 0; i < n; i += BLOCK)
+  {
+    const int m = std::min(BLOCK, n - i);
+    Hamming::distances8U(a, b + (size_t)i * bytes, bytes, m, db);
+
+    for(int j = 0; j < m; ++j) d[i + j] = db[j];
+  }
+}
+
 // --------------------------------------------------------------------------
   
 std::string FORB::toString(const FORB::TDescriptor &a)
@@ -152,6 +206,29 @@ void FORB::fromString(FORB::TDescriptor &a, const std::string &s)
 
 // --------------------------------------------------------------------------
 
+int FORB::size8U(const FORB::TDescriptor &a)
+{
+  return a.cols;
+}
+
+// --------------------------------------------------------------------------
+
+void FORB::toArray8U(const FORB::TDescriptor &a, unsigned char *p)
+{
+  if(a.cols > 0) memcpy(p, a.ptr<unsigned char>(), a.cols);
+}
+
+// --------------------------------------------------------------------------
+
+void FORB::fromArray8U(FORB::TDescriptor &a, const unsigned char *p,
+  int bytes)
+{
+  a.create(1, bytes, CV_8U);
+  memcpy(a.ptr<unsigned char>(), p, bytes);
+}
+
+// --------------------------------------------------------------------------
+
 void FORB::toMat32F(const std::vector<TDescriptor> &descriptors, 
   cv::Mat &mat)
 {
@@ -9,6 +9,7 @@
  
 #include <vector>
 #include <string>
+#include <cstring>
 #include <sstream>
 
 #include "FClass.h"
@@ -59,6 +60,36 @@ double FSurf64::distance(const FSurf64::TDescriptor &a, const FSurf64::TDescript
 
 // --------------------------------------------------------------------------
 
+void FSurf64::distances(const FSurf64::TDescriptor &a, const FSurf64::TDescriptor *b,
+  int n, double *d)
+{
+  for(int i = 0; i < n; ++i) d[i] = distance(a, b[i]);
+}
+
+// --------------------------------------------------------------------------
+
+void FSurf64::distances8U(const unsigned char *a, const unsigned char *b,
+  int bytes, int n, double *d)
+{
+  // the floats are copied, since the bytes may not be aligned for them
+  const int L = bytes / sizeof(float);
+
+  for(int i = 0; i < n; ++i, b += bytes)
+  {
+    double sqd = 0.;
+    for(int j = 0; j < L; ++j)
+    {
+      float fa, fb;
+      memcpy(&fa, a + j * sizeof(float), sizeof(float));
+      memcpy(&fb, b + j * sizeof(float), sizeof(float));
+      sqd += (fa - fb)*(fa - fb);
+    }
+    d[i] = sqd;
+  }
+}
+
+// --------------------------------------------------------------------------
+
 std::string FSurf64::toString(const FSurf64::TDescriptor &a)
 {
   stringstream ss;
@@ -84,6 +115,29 @@ void FSurf64::fromString(FSurf64::TDescriptor &a, const std::string &s)
 
 // --------------------------------------------------------------------------
 
+int FSurf64::size8U(const FSurf64::TDescriptor &a)
+{
+  return (int)(a.size() * sizeof(float));
+}
+
+// --------------------------------------------------------------------------
+
+void FSurf64::toArray8U(const FSurf64::TDescriptor &a, unsigned char *p)
+{
+  if(!a.empty()) memcpy(p, &a[0], a.size() * sizeof(float));
+}
+
+// --------------------------------------------------------------------------
+
+void FSurf64::fromArray8U(FSurf64::TDescriptor &a, const unsigned char *p,
+  int bytes)
+{
+  a.resize(bytes / sizeof(float));
+  if(!a.empty()) memcpy(&a[0], p, a.size() * sizeof(float));
+}
+
+// --------------------------------------------------------------------------
+
 void FSurf64::toMat32F(const std::vector<TDescriptor> &descriptors, 
     cv::Mat &mat)
 {
@@ -8,8 +8,8 @@
  */
 
 #include "FeatureVector.h"
-#include <map>
 #include <vector>
+#include <algorithm>
 #include <iostream>
 
 namespace DBoW2 {
@@ -30,18 +30,120 @@ FeatureVector::~FeatureVector(void)
 
 void FeatureVector::addFeature(NodeId id, unsigned int i_feature)
 {
-  FeatureVector::iterator vit = this->lower_bound(id);
-  
-  if(vit != this->end() && vit->first == id)
+  if(m_nodes.empty()) m_offsets.push_back(0);
+
+  // appending to the last node or after it does not move anything
+  if(m_nodes.empty() || m_nodes.back() < id)
   {
-    vit->second.push_back(i_feature);
+    m_nodes.push_back(id);
+    m_features.push_back(i_feature);
+    m_offsets.push_back(m_features.size());
+    return;
+  }
+
+  const size_t k = std::lower_bound(m_nodes.begin(), m_nodes.end(), id) -
+    m_nodes.begin();
+
+  if(m_nodes[k] == id)
+  {
+    m_features.insert(m_features.begin() + m_offsets[k+1], i_feature);
   }
   else
   {
-    vit = this->insert(vit, FeatureVector::value_type(id, 
-      std::vector<unsigned int>() ));
-    vit->second.push_back(i_feature);
+    m_features.insert(m_features.begin() + m_offsets[k], i_feature);
+    const unsigned int offset = m_offsets[k];
+    m_nodes.insert(m_nodes.begin() + k, id);
+    m_offsets.insert(m_offsets.begin() + k, offset);
   }
+
+  for(size_t i = k + 1; i < m_offsets.size(); ++i) ++m_offsets[i];
+}
+
+// ---------------------------------------------------------------------------
+
+/// Orders the features by node id
+static inline bool lessNodeId(const std::pair<NodeId, unsigned int> &a,
+  const std::pair<NodeId, unsigned int> &b)
+{
+  return a.first < b.first;
+}
+
+// ---------------------------------------------------------------------------
+
+void FeatureVector::sortAndMerge()
+{
+  // m_nodes and m_features have one item per feature
+  const size_t n = m_features.size();
+
+  std::vector<std::pair<NodeId, unsigned int> > items(n);
+  for(size_t i = 0; i < n; ++i)
+    items[i] = std::make_pair(m_nodes[i], m_features[i]);
+
+  std::stable_sort(items.begin(), items.end(), lessNodeId);
+
+  m_nodes.clear();
+  m_offsets.clear();
+  for(size_t i = 0; i < n; ++i)
+  {
+    if(i == 0 || items[i].first != items[i-1].first)
+    {
+      m_nodes.push_back(items[i].first);
+      m_offsets.push_back(i);
+    }
+    m_features[i] = items[i].second;
+  }
+  if(n > 0) m_offsets.push_back(n);
+}
+
+// ---------------------------------------------------------------------------
+
+void FeatureVector::reserve(size_t nodes, size_t features)
+{
+  m_nodes.reserve(nodes);
+  m_offsets.reserve(nodes + 1);
+  m_features.reserve(features);
+}
+
+// ---------------------------------------------------------------------------
+
+void FeatureVector::clear()
+{
+  m_nodes.clear();
+  m_offsets.clear();
+  m_features.clear();
+}
+
+// ---------------------------------------------------------------------------
+
+void FeatureVector::swap(FeatureVector &fv)
+{
+  m_nodes.swap(fv.m_nodes);
+  m_offsets.swap(fv.m_offsets);
+  m_features.swap(fv.m_features);
+}
+
+// ---------------------------------------------------------------------------
+
+FeatureVector::const_iterator FeatureVector::lower_bound(NodeId id) const
+{
+  return const_iterator(this,
+    std::lower_bound(m_nodes.begin(), m_nodes.end(), id) - m_nodes.begin());
+}
+
+// ---------------------------------------------------------------------------
+
+FeatureVector::const_iterator FeatureVector::find(NodeId id) const
+{
+  const_iterator it = lower_bound(id);
+  return (it != end() && m_nodes[it.index()] == id ? it : end());
+}
+
+// ---------------------------------------------------------------------------
+
+FeatureIndices FeatureVector::featuresOf(NodeId id) const
+{
+  const_iterator it = find(id);
+  return (it != end() ? it->second : FeatureIndices());
 }
 
 // ---------------------------------------------------------------------------
@@ -53,25 +155,25 @@ std::ostream& operator<<(std::ostream &out,
   {
     FeatureVector::const_iterator vit = v.begin();
     
-    const std::vector<unsigned int>* f = &vit->second;
+    FeatureIndices f = vit->second;
 
     out << "<" << vit->first << ": [";
-    if(!f->empty()) out << (*f)[0];
-    for(unsigned int i = 1; i < f->size(); ++i)
+    if(!f.empty()) out << f[0];
+    for(unsigned int i = 1; i < f.size(); ++i)
     {
-      out << ", " << (*f)[i];
+      out << ", " << f[i];
     }
     out << "]>";
     
     for(++vit; vit != v.end(); ++vit)
     {
-      f = &vit->second;
+      f = vit->second;
       
       out << ", <" << vit->first << ": [";
-      if(!f->empty()) out << (*f)[0];
-      for(unsigned int i = 1; i < f->size(); ++i)
+      if(!f.empty()) out << f[0];
+      for(unsigned int i = 1; i < f.size(); ++i)
       {
-        out << ", " << (*f)[i];
+        out << ", " << f[i];
       }
       out << "]>";
     }
@@ -0,0 +1,313 @@
+/**
+ * File: Hamming.cpp
+ * Description: Hamming distance kernels for 256-bit binary descriptors,
+ *   selected at run time according to the instruction sets of the CPU
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <cstring>
+#include <atomic>
+#include <stdint.h>
+#include <limits.h>
+
+#include "Hamming.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+  (defined(__x86_64__) || defined(__i386__))
+  #define DBOW2_HAMMING_X86
+  #include <immintrin.h>
+#endif
+
+namespace DBoW2 {
+
+namespace {
+
+/// Distance between two descriptors
+typedef int (*DistanceFunction)(const unsigned char *, const unsigned char *);
+
+/// Distances between one descriptor and several ones
+typedef void (*DistancesFunction)(const unsigned char *,
+  const unsigned char * const *, int, int *);
+
+// --------------------------------------------------------------------------
+// Portable version
+
+inline uint64_t load64(const unsigned char *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v)); // unaligned
+  return v;
+}
+
+inline int popcount64Generic(uint64_t v)
+{
+  // Bit count function got from:
+  // http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel
+  v = v - ((v >> 1) & (uint64_t)~(uint64_t)0/3);
+  v = (v & (uint64_t)~(uint64_t)0/15*3) + ((v >> 2) &
+    (uint64_t)~(uint64_t)0/15*3);
+  v = (v + (v >> 4)) & (uint64_t)~(uint64_t)0/255*15;
+  return (int)((uint64_t)(v * ((uint64_t)~(uint64_t)0/255)) >>
+    (sizeof(uint64_t) - 1) * CHAR_BIT);
+}
+
+int distanceGeneric(const unsigned char *a, const unsigned char *b)
+{
+  int ret = 0;
+  for(int i = 0; i < Hamming::L; i += 8)
+    ret += popcount64Generic(load64(a + i) ^ load64(b + i));
+  return ret;
+}
+
+void distancesGeneric(const unsigned char *a,
+  const unsigned char * const *b, int n, int *d)
+{
+  const uint64_t a0 = load64(a), a1 = load64(a + 8),
+    a2 = load64(a + 16), a3 = load64(a + 24);
+
+  for(int i = 0; i < n; ++i)
+  {
+    const unsigned char *p = b[i];
+    d[i] = popcount64Generic(a0 ^ load64(p))
+      + popcount64Generic(a1 ^ load64(p + 8))
+      + popcount64Generic(a2 ^ load64(p + 16))
+      + popcount64Generic(a3 ^ load64(p + 24));
+  }
+}
+
+#ifdef DBOW2_HAMMING_X86
+
+// --------------------------------------------------------------------------
+// POPCNT instruction
+
+__attribute__((target("popcnt")))
+int distancePopcnt(const unsigned char *a, const unsigned char *b)
+{
+  return __builtin_popcountll(load64(a) ^ load64(b))
+    + __builtin_popcountll(load64(a + 8) ^ load64(b + 8))
+    + __builtin_popcountll(load64(a + 16) ^ load64(b + 16))
+    + __builtin_popcountll(load64(a + 24) ^ load64(b + 24));
+}
+
+__attribute__((target("popcnt")))
+void distancesPopcnt(const unsigned char *a,
+  const unsigned char * const *b, int n, int *d)
+{
+  const uint64_t a0 = load64(a), a1 = load64(a + 8),
+    a2 = load64(a + 16), a3 = load64(a + 24);
+
+  for(int i = 0; i < n; ++i)
+  {
+    const unsigned char *p = b[i];
+    d[i] = __builtin_popcountll(a0 ^ load64(p))
+      + __builtin_popcountll(a1 ^ load64(p + 8))
+      + __builtin_popcountll(a2 ^ load64(p + 16))
+      + __builtin_popcountll(a3 ^ load64(p + 24));
+  }
+}
+
+// --------------------------------------------------------------------------
+// AVX2: bit count of each nibble with a lookup table (vpshufb)
+
+__attribute__((target("avx2")))
+inline int sum64Avx2(__m256i v)
+{
+  // v holds 4 64-bit sums
+  __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v),
+    _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+  return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+inline int popcount256Avx2(__m256i v)
+{
+  const __m256i lut = _mm256_setr_epi8(
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+
+  const __m256i lo = _mm256_and_si256(v, low_mask);
+  const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+  const __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+    _mm256_shuffle_epi8(lut, hi));
+
+  // add the counts of each 8 bytes
+  return sum64Avx2(_mm256_sad_epu8(counts, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+int distanceAvx2(const unsigned char *a, const unsigned char *b)
+{
+  const __m256i va = _mm256_loadu_si256((const __m256i*)a);
+  const __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+  return popcount256Avx2(_mm256_xor_si256(va, vb));
+}
+
+__attribute__((target("avx2")))
+void distancesAvx2(const unsigned char *a,
+  const unsigned char * const *b, int n, int *d)
+{
+  const __m256i va = _mm256_loadu_si256((const __m256i*)a);
+  for(int i = 0; i < n; ++i)
+  {
+    const __m256i vb = _mm256_loadu_si256((const __m256i*)b[i]);
+    d[i] = popcount256Avx2(_mm256_xor_si256(va, vb));
+  }
+}
+
+// --------------------------------------------------------------------------
+// AVX-512 VPOPCNTDQ (on 256-bit registers)
+
+__attribute__((target("avx512vpopcntdq,avx512vl,avx2")))
+int distanceAvx512(const unsigned char *a, const unsigned char *b)
+{
+  const __m256i va = _mm256_loadu_si256((const __m256i*)a);
+  const __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+  return sum64Avx2(_mm256_popcnt_epi64(_mm256_xor_si256(va, vb)));
+}
+
+__attribute__((target("avx512vpopcntdq,avx512vl,avx2")))
+void distancesAvx512(const unsigned char *a,
+  const unsigned char * const *b, int n, int *d)
+{
+  const __m256i va = _mm256_loadu_si256((const __m256i*)a);
+  for(int i = 0; i < n; ++i)
+  {
+    const __m256i vb = _mm256_loadu_si256((const __m256i*)b[i]);
+    d[i] = sum64Avx2(_mm256_popcnt_epi64(_mm256_xor_si256(va, vb)));
+  }
+}
+
+#endif // DBOW2_HAMMING_X86
+
+// --------------------------------------------------------------------------
+// Dispatch
+
+int distanceResolve(const unsigned char *a, const unsigned char *b);
+void distancesResolve(const unsigned char *a,
+  const unsigned char * const *b, int n, int *d);
+
+/// Functions in use. They point to the resolvers until the first call
+std::atomic<DistanceFunction> g_distance(&distanceResolve);
+std::atomic<DistancesFunction> g_distances(&distancesResolve);
+std::atomic<const char*> g_implementation(static_cast<const char*>(NULL));
+
+/**
+ * Chooses the best implementation for this CPU and stores it in g_distance
+ * and g_distances
+ */
+void resolve()
+{
+  DistanceFunction distance = &distanceGeneric;
+  DistancesFunction distances = &distancesGeneric;
+  const char *name = "generic";
+
+#ifdef DBOW2_HAMMING_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512vpopcntdq") &&
+    __builtin_cpu_supports("avx512vl"))
+  {
+    distance = &distanceAvx512;
+    distances = &distancesAvx512;
+    name = "avx512";
+  }
+  else if(__builtin_cpu_supports("avx2"))
+  {
+    distance = &distanceAvx2;
+    distances = &distancesAvx2;
+    name = "avx2";
+  }
+  else if(__builtin_cpu_supports("popcnt"))
+  {
+    distance = &distancePopcnt;
+    distances = &distancesPopcnt;
+    name = "popcnt";
+  }
+#endif
+
+  // several threads may get here at the same time, but all of them store
+  // the same values
+  g_distance.store(distance, std::memory_order_relaxed);
+  g_distances.store(distances, std::memory_order_relaxed);
+  g_implementation.store(name, std::memory_order_relaxed);
+}
+
+int distanceResolve(const unsigned char *a, const unsigned char *b)
+{
+  resolve();
+  return g_distance.load(std::memory_order_relaxed)(a, b);
+}
+
+void distancesResolve(const unsigned char *a,
+  const unsigned char * const *b, int n, int *d)
+{
+  resolve();
+  g_distances.load(std::memory_order_relaxed)(a, b, n, d);
+}
+
+} // namespace
+
+// --------------------------------------------------------------------------
+
+int Hamming::distance256(const unsigned char *a, const unsigned char *b)
+{
+  return g_distance.load(std::memory_order_relaxed)(a, b);
+}
+
+// --------------------------------------------------------------------------
+
+void Hamming::distances256(const unsigned char *a,
+  const unsigned char * const *b, int n, int *d)
+{
+  g_distances.load(std::memory_order_relaxed)(a, b, n, d);
+}
+
+// --------------------------------------------------------------------------
+
+void Hamming::distances8U(const unsigned char *a, const unsigned char *b,
+  int bytes, int n, int *d)
+{
+  if(bytes == Hamming::L)
+  {
+    // the descriptors are given to the kernel in blocks
+    const int BLOCK = 16;
+    const unsigned char *pb[BLOCK];
+    const DistancesFunction distances =
+      g_distances.load(std::memory_order_relaxed);
+
+    for(int i = 0; i < n; i += BLOCK)
+    {
+      const int m = (n - i < BLOCK ? n - i : BLOCK);
+      for(int j = 0; j < m; ++j) pb[j] = b + (size_t)(i + j) * bytes;
+
+      distances(a, pb, m, d + i);
+    }
+    return;
+  }
+
+  for(int i = 0; i < n; ++i, b += bytes)
+  {
+    int ret = 0;
+    int k = 0;
+    for(; k + 8 <= bytes; k += 8)
+      ret += popcount64Generic(load64(a + k) ^ load64(b + k));
+    for(; k < bytes; ++k)
+      ret += popcount64Generic((uint64_t)(a[k] ^ b[k]));
+    d[i] = ret;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+const char* Hamming::implementation()
+{
+  if(g_implementation.load(std::memory_order_relaxed) == NULL) resolve();
+  return g_implementation.load(std::memory_order_relaxed);
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
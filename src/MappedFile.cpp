@@ -0,0 +1,70 @@
+/**
+ * File: MappedFile.cpp
+ * Description: read-only file mapped into memory
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <string>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "MappedFile.h"
+
+namespace DBoW2 {
+
+// --------------------------------------------------------------------------
+
+MappedFile::MappedFile(const std::string &filename)
+  : m_data(NULL), m_size(0)
+{
+#ifdef _WIN32
+  throw std::string("Memory-mapped files are not supported in this system: ")
+    + filename;
+#else
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0) throw std::string("Could not open file ") + filename;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0)
+  {
+    close(fd);
+    throw std::string("Could not read file ") + filename;
+  }
+
+  m_size = (size_t)st.st_size;
+
+  if(m_size > 0)
+  {
+    void *p = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED)
+    {
+      close(fd);
+      throw std::string("Could not map file ") + filename;
+    }
+    m_data = static_cast<const unsigned char*>(p);
+  }
+
+  // the mapping stays valid after closing the file
+  close(fd);
+#endif
+}
+
+// --------------------------------------------------------------------------
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+  if(m_data != NULL) munmap(const_cast<unsigned char*>(m_data), m_size);
+#endif
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
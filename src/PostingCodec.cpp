@@ -0,0 +1,86 @@
+/**
+ * File: PostingCodec.cpp
+ * Description: compression of blocks of postings of the inverted files
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+
+#include "PostingCodec.h"
+
+namespace DBoW2 {
+
+const size_t PostingCodec::BLOCK;
+const size_t PostingCodec::MAX_BYTES;
+
+// --------------------------------------------------------------------------
+
+size_t PostingCodec::encode(const EntryId *entry_ids,
+  const WordValue *word_weights, PostingCompression compression,
+  PostingBlock &block, unsigned char *data)
+{
+  // entry ids: the difference of the first one is 0
+  EntryId max_delta = 0;
+  for(size_t i = 1; i < BLOCK; ++i)
+    max_delta = std::max(max_delta, entry_ids[i] - entry_ids[i-1]);
+
+  unsigned int bits = 0;
+  while(bits < 32 && (max_delta >> bits) != 0) ++bits;
+
+  block.first = entry_ids[0];
+  block.id_bits = (uint8_t)bits;
+
+  const size_t id_bytes = BLOCK * bits / 8;
+  memset(data, 0, id_bytes);
+  for(size_t i = 1; i < BLOCK; ++i)
+  {
+    const size_t bit = i * bits;
+    uint64_t v = (uint64_t)(entry_ids[i] - entry_ids[i-1]) << (bit % 8);
+    for(unsigned char *p = data + bit / 8; v != 0; ++p, v >>= 8)
+      *p |= (unsigned char)v;
+  }
+
+  // weights
+  const unsigned int qmax = (compression == COMPRESSED_8 ? 0xff : 0xffff);
+
+  WordValue max_weight = 0;
+  for(size_t i = 0; i < BLOCK; ++i)
+    max_weight = std::max(max_weight, word_weights[i]);
+
+  block.scale = (float)(max_weight / qmax);
+  block.weight_bits = (compression == COMPRESSED_8 ? 8 : 16);
+
+  unsigned char *w = data + id_bytes;
+  for(size_t i = 0; i < BLOCK; ++i)
+  {
+    unsigned int q = 0;
+    if(block.scale > 0)
+    {
+      // non-zero weights are not rounded down to 0, since scorings like
+      // KL tell zero weights apart
+      const double x = word_weights[i] / block.scale;
+      if(x >= qmax) q = qmax;
+      else if(x > 0) q = std::max(1u, (unsigned int)(x + 0.5));
+    }
+
+    if(block.weight_bits == 8)
+    {
+      w[i] = (unsigned char)q;
+    }
+    else
+    {
+      w[2*i] = (unsigned char)(q & 0xff);
+      w[2*i + 1] = (unsigned char)(q >> 8);
+    }
+  }
+
+  return id_bytes + BLOCK * (block.weight_bits / 8);
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
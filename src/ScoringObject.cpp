@@ -7,15 +7,15 @@
  *
  */
 
-#include <cfloat>
+#include <limits>
 #include "TemplatedVocabulary.h"
 #include "BowVector.h"
 
 using namespace DBoW2;
 
-// If you change the type of WordValue, make sure you change also the
-// epsilon value (this is needed by the KL method)
-const double GeneralScoring::LOG_EPS = log(DBL_EPSILON); // FLT_EPSILON
+// The epsilon of WordValue stands for the missing values in the KL method
+const double GeneralScoring::LOG_EPS =
+  log((double)std::numeric_limits<WordValue>::epsilon());
 
 // ---------------------------------------------------------------------------
 // ---------------------------------------------------------------------------
@@ -47,14 +47,12 @@ double L1Scoring::score(const BowVector &v1, const BowVector &v2) const
     else if(v1_it->first < v2_it->first)
     {
       // move v1 forward
-      v1_it = v1.lower_bound(v2_it->first);
-      // v1_it = (first element >= v2_it.id)
+      ++v1_it;
     }
     else
     {
       // move v2 forward
-      v2_it = v2.lower_bound(v1_it->first);
-      // v2_it = (first element >= v1_it.id)
+      ++v2_it;
     }
   }
   
@@ -97,14 +95,12 @@ double L2Scoring::score(const BowVector &v1, const BowVector &v2) const
     else if(v1_it->first < v2_it->first)
     {
       // move v1 forward
-      v1_it = v1.lower_bound(v2_it->first);
-      // v1_it = (first element >= v2_it.id)
+      ++v1_it;
     }
     else
     {
       // move v2 forward
-      v2_it = v2.lower_bound(v1_it->first);
-      // v2_it = (first element >= v1_it.id)
+      ++v2_it;
     }
   }
   
@@ -154,12 +150,12 @@ double ChiSquareScoring::score(const BowVector &v1, const BowVector &v2)
     else if(v1_it->first < v2_it->first)
     {
       // move v1 forward
-      v1_it = v1.lower_bound(v2_it->first);
+      ++v1_it;
     }
     else
     {
       // move v2 forward
-      v2_it = v2.lower_bound(v1_it->first);
+      ++v2_it;
     }
   }
     
@@ -192,7 +188,7 @@ double KLScoring::score(const BowVector &v1, const BowVector &v2) const
     
     if(v1_it->first == v2_it->first)
     {
-      if(vi != 0 && wi != 0) score += vi * log(vi/wi);
+      if(vi != 0 && wi != 0) score += vi * log((double)vi / wi);
       
       // move v1 and v2 forward
       ++v1_it;
@@ -201,21 +197,20 @@ double KLScoring::score(const BowVector &v1, const BowVector &v2) const
     else if(v1_it->first < v2_it->first)
     {
       // move v1 forward
-      score += vi * (log(vi) - LOG_EPS);
+      score += vi * (log((double)vi) - LOG_EPS);
       ++v1_it;
     }
     else
     {
       // move v2_it forward, do not add any score
-      v2_it = v2.lower_bound(v1_it->first);
-      // v2_it = (first element >= v1_it.id)
+      ++v2_it;
     }
   }
   
   // sum rest of items of v
   for(; v1_it != v1_end; ++v1_it) 
     if(v1_it->second != 0)
-      score += v1_it->second * (log(v1_it->second) - LOG_EPS);
+      score += v1_it->second * (log((double)v1_it->second) - LOG_EPS);
   
   return score; // cannot be scaled
 }
@@ -251,14 +246,12 @@ double BhattacharyyaScoring::score(const BowVector &v1,
     else if(v1_it->first < v2_it->first)
     {
       // move v1 forward
-      v1_it = v1.lower_bound(v2_it->first);
-      // v1_it = (first element >= v2_it.id)
+      ++v1_it;
     }
     else
     {
       // move v2 forward
-      v2_it = v2.lower_bound(v1_it->first);
-      // v2_it = (first element >= v1_it.id)
+      ++v2_it;
     }
   }
 
@@ -296,14 +289,12 @@ double DotProductScoring::score(const BowVector &v1,
     else if(v1_it->first < v2_it->first)
     {
       // move v1 forward
-      v1_it = v1.lower_bound(v2_it->first);
-      // v1_it = (first element >= v2_it.id)
+      ++v1_it;
     }
     else
     {
       // move v2 forward
-      v2_it = v2.lower_bound(v1_it->first);
-      // v2_it = (first element >= v1_it.id)
+      ++v2_it;
     }
   }
 
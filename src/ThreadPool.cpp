@@ -0,0 +1,267 @@
+/**
+ * File: ThreadPool.cpp
+ * Description: pool of worker threads with work stealing
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <chrono>
+
+#include "ThreadPool.h"
+
+namespace DBoW2 {
+
+namespace {
+
+/// Pool the current thread works for, if any
+thread_local const ThreadPool *t_pool = NULL;
+
+/// Index of the current thread among the workers of t_pool
+thread_local int t_worker = -1;
+
+} // namespace
+
+// --------------------------------------------------------------------------
+
+ThreadPool::TaskGroup::TaskGroup(ThreadPool &pool)
+  : m_pool(pool), m_pending(0)
+{
+}
+
+// --------------------------------------------------------------------------
+
+ThreadPool::TaskGroup::~TaskGroup()
+{
+  try
+  {
+    wait();
+  }
+  catch(...)
+  {
+    // errors must be retrieved by calling wait() explicitly
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void ThreadPool::TaskGroup::run(const Task &task)
+{
+  if(m_pool.m_workers.empty())
+  {
+    // no parallelism: run it now
+    try
+    {
+      task();
+    }
+    catch(...)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(!m_error) m_error = std::current_exception();
+    }
+    return;
+  }
+
+  Item item;
+  item.task = task;
+  item.group = this;
+
+  m_pending.fetch_add(1);
+  m_pool.push(item);
+}
+
+// --------------------------------------------------------------------------
+
+void ThreadPool::TaskGroup::wait()
+{
+  while(m_pending.load() > 0)
+  {
+    Item item;
+    if(m_pool.pop(item))
+    {
+      execute(item);
+    }
+    else
+    {
+      // the remaining tasks are running in other threads
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_finished.wait_for(lock, std::chrono::milliseconds(1));
+    }
+  }
+
+  std::exception_ptr error;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::swap(error, m_error);
+  }
+  if(error) std::rethrow_exception(error);
+}
+
+// --------------------------------------------------------------------------
+
+void ThreadPool::TaskGroup::finish(const std::exception_ptr &error)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if(error && !m_error) m_error = error;
+  if(m_pending.fetch_sub(1) == 1) m_finished.notify_all();
+}
+
+// --------------------------------------------------------------------------
+
+ThreadPool::ThreadPool(int threads)
+  : m_queued(0), m_stop(false)
+{
+  if(threads <= 0) threads = hardwareThreads();
+
+  m_queues.resize(threads); // threads - 1 workers + shared queue
+  for(size_t i = 0; i < m_queues.size(); ++i) m_queues[i] = new Queue;
+
+  for(int i = 0; i < threads - 1; ++i)
+    m_workers.push_back(std::thread(&ThreadPool::work, this, i));
+}
+
+// --------------------------------------------------------------------------
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_available.notify_all();
+
+  for(size_t i = 0; i < m_workers.size(); ++i) m_workers[i].join();
+  for(size_t i = 0; i < m_queues.size(); ++i) delete m_queues[i];
+}
+
+// --------------------------------------------------------------------------
+
+int ThreadPool::hardwareThreads()
+{
+  const int n = (int)std::thread::hardware_concurrency();
+  return (n > 0 ? n : 1);
+}
+
+// --------------------------------------------------------------------------
+
+int ThreadPool::currentWorker() const
+{
+  return (t_pool == this ? t_worker : -1);
+}
+
+// --------------------------------------------------------------------------
+
+void ThreadPool::push(const Item &item)
+{
+  int q = currentWorker();
+  if(q < 0) q = (int)m_queues.size() - 1;
+
+  {
+    std::lock_guard<std::mutex> lock(m_queues[q]->mutex);
+    m_queues[q]->items.push_back(item);
+  }
+
+  {
+    // taken so that a worker cannot miss the notification between checking
+    // m_queued and going to sleep
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queued.fetch_add(1);
+  }
+  m_available.notify_one();
+}
+
+// --------------------------------------------------------------------------
+
+bool ThreadPool::pop(Item &item)
+{
+  if(m_queued.load() <= 0) return false;
+
+  const int nq = (int)m_queues.size();
+  const int shared = nq - 1;
+  const int own = currentWorker();
+
+  // own tasks, newest first
+  if(own >= 0)
+  {
+    Queue &q = *m_queues[own];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if(!q.items.empty())
+    {
+      item = q.items.back();
+      q.items.pop_back();
+      m_queued.fetch_sub(1);
+      return true;
+    }
+  }
+
+  // shared tasks and tasks of other workers, oldest first
+  for(int i = 0; i < nq; ++i)
+  {
+    const int idx = (shared + i) % nq;
+    if(idx == own) continue;
+
+    Queue &q = *m_queues[idx];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if(!q.items.empty())
+    {
+      item = q.items.front();
+      q.items.pop_front();
+      m_queued.fetch_sub(1);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// --------------------------------------------------------------------------
+
+void ThreadPool::execute(Item &item)
+{
+  std::exception_ptr error;
+  try
+  {
+    item.task();
+  }
+  catch(...)
+  {
+    error = std::current_exception();
+  }
+
+  // the task may hold resources of the group
+  item.task = Task();
+  item.group->finish(error);
+}
+
+// --------------------------------------------------------------------------
+
+void ThreadPool::work(int index)
+{
+  t_pool = this;
+  t_worker = index;
+
+  while(true)
+  {
+    Item item;
+    if(pop(item))
+    {
+      execute(item);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_available.wait(lock, [this]{ return m_stop || m_queued.load() > 0; });
+    if(m_stop) break;
+  }
+
+  t_pool = NULL;
+  t_worker = -1;
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
@@ -0,0 +1,145 @@
+/**
+ * File: TransformCache.cpp
+ * Description: cache of the words of features already transformed
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <string>
+#include <stdint.h>
+
+#include "TransformCache.h"
+#include "BinaryIO.h"
+
+namespace DBoW2 {
+
+const TrackId TransformCache::NO_TRACK;
+const size_t TransformCache::WAYS;
+
+// --------------------------------------------------------------------------
+
+TransformCache::TransformCache(size_t capacity, unsigned int shards)
+  : m_nshards(shards)
+{
+  if(capacity == 0 || shards == 0)
+    throw std::string("The cache must have one slot and one shard at least");
+
+  m_sets = ((capacity + shards - 1) / shards + WAYS - 1) / WAYS;
+  m_shards.reset(new Shard[shards]);
+
+  for(unsigned int i = 0; i < shards; ++i)
+  {
+    Slot empty;
+    empty.key = 0;
+    empty.used = 0;
+
+    m_shards[i].slots.assign(m_sets * WAYS, empty);
+    m_shards[i].hits = 0;
+    m_shards[i].misses = 0;
+    m_shards[i].clock = 0;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+bool TransformCache::find(uint64_t key, int levelsup, Value &value)
+{
+  Shard *shard;
+  Slot *set = setOf(key, shard);
+
+  std::lock_guard<std::mutex> lock(shard->mutex);
+
+  for(size_t i = 0; i < WAYS; ++i)
+  {
+    Slot &slot = set[i];
+    if(slot.used && slot.key == key &&
+      (levelsup < 0 || slot.value.levelsup == levelsup))
+    {
+      value = slot.value;
+      slot.used = ++shard->clock;
+      ++shard->hits;
+      return true;
+    }
+  }
+
+  ++shard->misses;
+  return false;
+}
+
+// --------------------------------------------------------------------------
+
+void TransformCache::insert(uint64_t key, const Value &value)
+{
+  Shard *shard;
+  Slot *set = setOf(key, shard);
+
+  std::lock_guard<std::mutex> lock(shard->mutex);
+
+  // the slot of the key if it is there, or else the one used least
+  // recently (empty slots have the oldest time)
+  Slot *slot = set;
+  for(size_t i = 0; i < WAYS; ++i)
+  {
+    if(set[i].used && set[i].key == key)
+    {
+      slot = set + i;
+      break;
+    }
+    if(set[i].used < slot->used) slot = set + i;
+  }
+
+  slot->key = key;
+  slot->value = value;
+  slot->used = ++shard->clock;
+}
+
+// --------------------------------------------------------------------------
+
+void TransformCache::clear()
+{
+  for(unsigned int i = 0; i < m_nshards; ++i)
+  {
+    std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+
+    std::vector<Slot> &slots = m_shards[i].slots;
+    for(size_t j = 0; j < slots.size(); ++j) slots[j].used = 0;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+TransformCache::Stats TransformCache::stats() const
+{
+  Stats stats;
+  stats.hits = 0;
+  stats.misses = 0;
+
+  for(unsigned int i = 0; i < m_nshards; ++i)
+  {
+    std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+    stats.hits += m_shards[i].hits;
+    stats.misses += m_shards[i].misses;
+  }
+
+  return stats;
+}
+
+// --------------------------------------------------------------------------
+
+uint64_t TransformCache::descriptorKey(const unsigned char *data,
+  size_t bytes)
+{
+  return BinaryIO::checksum(data, bytes);
+}
+
+// --------------------------------------------------------------------------
+
+uint64_t TransformCache::trackKey(TrackId track)
+{
+  // apart from the keys of the descriptors
+  return mix(track ^ 0x9e3779b97f4a7c15ULL);
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2